@@ -1,53 +0,0 @@
-#include <vector>
-#include <fstream>
-#include <cstring>
-
-struct Pixel
-{
-  unsigned char r, g, b;
-};
-
-void WriteBMP(const char *fname, Pixel *a_pixelData, int width, int height)
-{
-  int paddedsize = (width * height) * sizeof(Pixel);
-
-  unsigned char bmpfileheader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
-  unsigned char bmpinfoheader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
-
-  bmpfileheader[2] = (unsigned char)(paddedsize);
-  bmpfileheader[3] = (unsigned char)(paddedsize >> 8);
-  bmpfileheader[4] = (unsigned char)(paddedsize >> 16);
-  bmpfileheader[5] = (unsigned char)(paddedsize >> 24);
-
-  bmpinfoheader[4] = (unsigned char)(width);
-  bmpinfoheader[5] = (unsigned char)(width >> 8);
-  bmpinfoheader[6] = (unsigned char)(width >> 16);
-  bmpinfoheader[7] = (unsigned char)(width >> 24);
-  bmpinfoheader[8] = (unsigned char)(height);
-  bmpinfoheader[9] = (unsigned char)(height >> 8);
-  bmpinfoheader[10] = (unsigned char)(height >> 16);
-  bmpinfoheader[11] = (unsigned char)(height >> 24);
-
-  std::ofstream out(fname, std::ios::out | std::ios::binary);
-  out.write((const char *)bmpfileheader, 14);
-  out.write((const char *)bmpinfoheader, 40);
-  out.write((const char *)a_pixelData, paddedsize);
-  out.flush();
-  out.close();
-}
-
-void SaveBMP(const char *fname, const unsigned int *pixels, int w, int h)
-{
-  std::vector<Pixel> pixels2(w * h);
-
-  for (size_t i = 0; i < pixels2.size(); i++)
-  {
-    Pixel px;
-    px.r = (pixels[i] & 0x00FF0000) >> 16;
-    px.g = (pixels[i] & 0x0000FF00) >> 8;
-    px.b = (pixels[i] & 0x000000FF);
-    pixels2[i] = px;
-  }
-
-  WriteBMP(fname, &pixels2[0], w, h);
-}
\ No newline at end of file
@@ -0,0 +1,506 @@
+#include "ImageWriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+ImageFormat imageFormatFromPath(const std::string &path)
+{
+  std::string ext = path.substr(path.find_last_of('.') == std::string::npos ? path.size() : path.find_last_of('.'));
+  for (size_t i = 0; i < ext.size(); i++)
+    ext[i] = (char)tolower(ext[i]);
+  if (ext == ".ppm")
+    return IMAGE_PPM;
+  if (ext == ".png")
+    return IMAGE_PNG;
+  if (ext == ".pfm")
+    return IMAGE_PFM;
+  return IMAGE_BMP;
+}
+
+static void put32le(unsigned char *p, uint32_t v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static void put32be(unsigned char *p, uint32_t v)
+{
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+// filled by the first caller; function-local statics are initialized once
+// even when server jobs write PNGs concurrently
+struct Crc32Table
+{
+  uint32_t entry[256];
+
+  Crc32Table()
+  {
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      entry[n] = c;
+    }
+  }
+};
+
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size)
+{
+  static const Crc32Table table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+ImageWriter::ImageWriter() : file(NULL), format(IMAGE_BMP), width(0), height(0), rows(0), adler(1) {}
+
+ImageWriter::~ImageWriter()
+{
+  if (file)
+    fclose(file);
+}
+
+bool ImageWriter::open(const std::string &path, ImageFormat a_format, int a_width, int a_height)
+{
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  format = a_format;
+  width = a_width;
+  height = a_height;
+  rows = 0;
+
+  if (format == IMAGE_BMP)
+  {
+    // rows are padded to a multiple of 4 bytes
+    uint32_t rowBytes = (3 * width + 3) & ~3u;
+    unsigned char header[54] = {'B', 'M'};
+    put32le(header + 2, 54 + rowBytes * height);
+    put32le(header + 10, 54);
+    put32le(header + 14, 40);
+    put32le(header + 18, width);
+    put32le(header + 22, height);
+    header[26] = 1;
+    header[28] = 24;
+    put32le(header + 34, rowBytes * height);
+    fwrite(header, 1, sizeof(header), file);
+    line.assign(rowBytes, 0);
+  }
+  else if (format == IMAGE_PFM)
+  {
+    // a negative scale marks little-endian floats
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+    floatLine.resize(3 * width);
+  }
+  else if (format == IMAGE_PPM)
+  {
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    line.resize(3 * width);
+  }
+  else
+  {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, 1, sizeof(signature), file);
+    unsigned char ihdr[13] = {0};
+    put32be(ihdr, width);
+    put32be(ihdr + 4, height);
+    ihdr[8] = 8; // bits per channel
+    ihdr[9] = 2; // truecolor
+    writeChunk("IHDR", ihdr, sizeof(ihdr));
+    // filter byte 0 (none) in front of every row
+    line.resize(1 + 3 * width);
+    idat.clear();
+    idat.push_back(0x78); // zlib header: deflate, 32K window, no dictionary
+    idat.push_back(0x01);
+    adler = 1;
+  }
+  return true;
+}
+
+void ImageWriter::writeRow(const unsigned int *pixels)
+{
+  if (!file || rows >= height)
+    return;
+  rows++;
+  if (format == IMAGE_BMP)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      line[3 * x] = (unsigned char)(pixels[x] >> 16);
+      line[3 * x + 1] = (unsigned char)(pixels[x] >> 8);
+      line[3 * x + 2] = (unsigned char)pixels[x];
+    }
+    fwrite(line.data(), 1, line.size(), file);
+    return;
+  }
+
+  unsigned char *rgb = format == IMAGE_PNG ? &line[1] : &line[0];
+  for (int x = 0; x < width; x++)
+  {
+    rgb[3 * x] = (unsigned char)pixels[x];
+    rgb[3 * x + 1] = (unsigned char)(pixels[x] >> 8);
+    rgb[3 * x + 2] = (unsigned char)(pixels[x] >> 16);
+  }
+  if (format == IMAGE_PPM)
+    fwrite(line.data(), 1, line.size(), file);
+  else
+  {
+    deflateStored(line.data(), line.size());
+    if (idat.size() >= (1 << 18))
+      flushIDAT();
+  }
+}
+
+void ImageWriter::writeRow(const float *r, const float *g, const float *b)
+{
+  if (!file || rows >= height)
+    return;
+  rows++;
+  for (int x = 0; x < width; x++)
+  {
+    floatLine[3 * x] = r[x];
+    floatLine[3 * x + 1] = g[x];
+    floatLine[3 * x + 2] = b[x];
+  }
+  unsigned char *bytes = (unsigned char *)floatLine.data();
+  for (size_t k = 0; k < floatLine.size(); k++)
+  {
+    uint32_t v;
+    memcpy(&v, &floatLine[k], 4);
+    put32le(bytes + 4 * k, v);
+  }
+  fwrite(bytes, 4, floatLine.size(), file);
+}
+
+bool ImageWriter::close()
+{
+  if (!file)
+    return false;
+  if (format == IMAGE_PNG)
+  {
+    // empty final block, then the Adler-32 of the uncompressed rows
+    static const unsigned char last[5] = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+    idat.insert(idat.end(), last, last + 5);
+    unsigned char check[4];
+    put32be(check, adler);
+    idat.insert(idat.end(), check, check + 4);
+    flushIDAT();
+    writeChunk("IEND", NULL, 0);
+  }
+  bool ok = rows == height && !ferror(file);
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  return ok;
+}
+
+void ImageWriter::deflateStored(const unsigned char *data, size_t size)
+{
+  uint32_t a = adler & 0xFFFF, b = adler >> 16;
+  for (size_t i = 0; i < size; i++)
+  {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  adler = b << 16 | a;
+
+  while (size > 0)
+  {
+    size_t n = std::min(size, (size_t)65535);
+    unsigned char head[5] = {0x00, (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8)};
+    idat.insert(idat.end(), head, head + 5);
+    idat.insert(idat.end(), data, data + n);
+    data += n;
+    size -= n;
+  }
+}
+
+void ImageWriter::flushIDAT()
+{
+  if (idat.empty())
+    return;
+  writeChunk("IDAT", idat.data(), idat.size());
+  idat.clear();
+}
+
+void ImageWriter::writeChunk(const char *type, const unsigned char *data, size_t size)
+{
+  unsigned char head[8];
+  put32be(head, (uint32_t)size);
+  memcpy(head + 4, type, 4);
+  uint32_t crc = crc32(0, head + 4, 4);
+  if (size)
+    crc = crc32(crc, data, size);
+  unsigned char tail[4];
+  put32be(tail, crc);
+  fwrite(head, 1, 8, file);
+  if (size)
+    fwrite(data, 1, size, file);
+  fwrite(tail, 1, 4, file);
+}
+
+bool StripWriter::open(const std::string &path, ImageFormat format, int a_width, int a_height, int a_stripHeight, int a_slots, const Quantizer &a_quantize)
+{
+  if (!writer.open(path, format, a_width, a_height))
+    return false;
+  width = a_width;
+  height = a_height;
+  stripHeight = std::max(1, a_stripHeight);
+  strips = (height + stripHeight - 1) / stripHeight;
+  slots = std::max(1, std::min(a_slots, strips));
+  quantize = a_quantize;
+  buffer.assign(3 * (size_t)slots * stripHeight * width, 0);
+  if (!writer.isFloat())
+    packed.assign((size_t)stripHeight * width, 0);
+  quantizeTime = 0;
+  owner.assign(slots, -1);
+  remaining.assign(slots, 0);
+  written = 0;
+  io = std::thread(&StripWriter::writeStrips, this);
+  return true;
+}
+
+void StripWriter::stripRows(int s, int &y0, int &y1) const
+{
+  // strips are cut from the image bottom; a top-down file starts at the last one
+  int k = writer.topDown() ? strips - 1 - s : s;
+  y0 = k * stripHeight;
+  y1 = std::min(height, y0 + stripHeight);
+}
+
+int StripWriter::stripOf(int y) const
+{
+  int k = y / stripHeight;
+  return writer.topDown() ? strips - 1 - k : k;
+}
+
+float *StripWriter::acquire(int s)
+{
+  int slot = s % slots;
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&] { return s < written + slots; });
+  if (owner[slot] != s)
+  {
+    int y0, y1;
+    stripRows(s, y0, y1);
+    owner[slot] = s;
+    remaining[slot] = (size_t)(y1 - y0) * width;
+  }
+  return &buffer[3 * (size_t)slot * planeSize()];
+}
+
+void StripWriter::done(int s, size_t pixels)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  remaining[s % slots] -= pixels;
+  if (remaining[s % slots] == 0)
+    changed.notify_all();
+}
+
+void StripWriter::writeStrips()
+{
+  for (int s = 0; s < strips; s++)
+  {
+    int slot = s % slots;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] { return owner[slot] == s && remaining[slot] == 0; });
+    }
+    // nobody touches a finished strip until it is released below
+    int y0, y1;
+    stripRows(s, y0, y1);
+    const float *red = &buffer[3 * (size_t)slot * planeSize()];
+    const float *green = red + planeSize(), *blue = green + planeSize();
+    size_t n = (size_t)(y1 - y0) * width;
+    if (!writer.isFloat())
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      quantize(red, green, blue, packed.data(), n);
+      quantizeTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+    for (int r = 0; r < y1 - y0; r++)
+    {
+      size_t row = (size_t)(writer.topDown() ? y1 - y0 - 1 - r : r) * width;
+      if (writer.isFloat())
+        writer.writeRow(red + row, green + row, blue + row);
+      else
+        writer.writeRow(packed.data() + row);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      owner[slot] = -1;
+      written++;
+    }
+    changed.notify_all();
+  }
+}
+
+bool StripWriter::close()
+{
+  if (io.joinable())
+    io.join();
+  return writer.close();
+}
+
+static const char partialMagic[] = "RTPART 2\n";
+static const long partialCountOffset = sizeof(partialMagic) - 1 + 2 * sizeof(uint32_t);
+
+static uint32_t get32le(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool writeWords(FILE *file, const uint32_t *words, size_t n)
+{
+  unsigned char buf[4 * 5];
+  for (size_t i = 0; i < n; i++)
+    put32le(buf + 4 * i, words[i]);
+  return fwrite(buf, 4, n, file) == n;
+}
+
+static bool readWords(FILE *file, uint32_t *words, size_t n)
+{
+  unsigned char buf[4 * 5];
+  if (fread(buf, 4, n, file) != n)
+    return false;
+  for (size_t i = 0; i < n; i++)
+    words[i] = get32le(buf + 4 * i);
+  return true;
+}
+
+PartialWriter::~PartialWriter()
+{
+  if (file)
+    fclose(file);
+}
+
+bool PartialWriter::open(const std::string &path, int width, int height, uint64_t frameHash)
+{
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  rects = 0;
+  uint32_t header[5] = {(uint32_t)width, (uint32_t)height, 0, (uint32_t)frameHash, (uint32_t)(frameHash >> 32)};
+  fwrite(partialMagic, 1, sizeof(partialMagic) - 1, file);
+  writeWords(file, header, 5);
+  return true;
+}
+
+void PartialWriter::writeRect(int x0, int y0, int x1, int y1, const float *r, const float *g, const float *b, size_t stride)
+{
+  uint32_t rect[4] = {(uint32_t)x0, (uint32_t)y0, (uint32_t)x1, (uint32_t)y1};
+  writeWords(file, rect, 4);
+  size_t w = x1 - x0;
+  bytes.resize(4 * w * (y1 - y0));
+  const float *channels[3] = {r, g, b};
+  for (int c = 0; c < 3; c++)
+  {
+    unsigned char *out = bytes.data();
+    for (int y = y0; y < y1; y++)
+    {
+      const float *row = channels[c] + (y - y0) * stride;
+      for (size_t x = 0; x < w; x++, out += 4)
+      {
+        uint32_t bits;
+        memcpy(&bits, &row[x], 4);
+        put32le(out, bits);
+      }
+    }
+    fwrite(bytes.data(), 1, bytes.size(), file);
+  }
+  rects++;
+}
+
+bool PartialWriter::close()
+{
+  if (!file)
+    return false;
+  bool ok = fseek(file, partialCountOffset, SEEK_SET) == 0 && writeWords(file, &rects, 1);
+  ok = !ferror(file) && ok;
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  return ok;
+}
+
+bool readPartialImage(const std::string &path, int &width, int &height, uint64_t &frameHash, std::vector<float> &r, std::vector<float> &g, std::vector<float> &b, std::vector<unsigned char> &coverage, std::string &error)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+  {
+    error = "cannot open " + path;
+    return false;
+  }
+  char magic[sizeof(partialMagic) - 1];
+  uint32_t header[5];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, partialMagic, sizeof(magic)) != 0 || !readWords(file, header, 5))
+  {
+    fclose(file);
+    error = path + " is not a partial image of this version";
+    return false;
+  }
+  frameHash = (uint64_t)header[4] << 32 | header[3];
+  if (width == 0)
+  {
+    width = header[0];
+    height = header[1];
+    size_t size = (size_t)width * height;
+    r.assign(size, 0.0f);
+    g.assign(size, 0.0f);
+    b.assign(size, 0.0f);
+    coverage.assign(size, 0);
+  }
+  else if ((int)header[0] != width || (int)header[1] != height)
+  {
+    fclose(file);
+    error = path + " has a different frame size";
+    return false;
+  }
+
+  std::vector<unsigned char> bytes;
+  for (uint32_t i = 0; i < header[2]; i++)
+  {
+    uint32_t rect[4];
+    if (!readWords(file, rect, 4) || rect[0] >= rect[2] || rect[1] >= rect[3] || (int)rect[2] > width || (int)rect[3] > height)
+    {
+      fclose(file);
+      error = path + " is truncated or damaged";
+      return false;
+    }
+    size_t w = rect[2] - rect[0];
+    bytes.resize(4 * w * (rect[3] - rect[1]));
+    float *channels[3] = {r.data(), g.data(), b.data()};
+    for (int c = 0; c < 3; c++)
+    {
+      if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size())
+      {
+        fclose(file);
+        error = path + " is truncated or damaged";
+        return false;
+      }
+      const unsigned char *in = bytes.data();
+      for (uint32_t y = rect[1]; y < rect[3]; y++)
+      {
+        float *row = channels[c] + (size_t)y * width + rect[0];
+        for (size_t x = 0; x < w; x++, in += 4)
+        {
+          uint32_t bits = get32le(in);
+          memcpy(&row[x], &bits, 4);
+        }
+      }
+    }
+    for (uint32_t y = rect[1]; y < rect[3]; y++)
+      for (uint32_t x = rect[0]; x < rect[2]; x++)
+        if (coverage[(size_t)y * width + x] < 255)
+          coverage[(size_t)y * width + x]++;
+  }
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,138 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum ImageFormat
+{
+    IMAGE_BMP, // 24-bit, rows stored bottom-up
+    IMAGE_PPM, // binary P6, top-down
+    IMAGE_PNG, // RGB8, stored (uncompressed) deflate blocks, top-down
+    IMAGE_PFM  // float RGB, little-endian, rows stored bottom-up
+};
+
+// by extension of `path`, BMP when it is not .ppm, .png or .pfm
+ImageFormat imageFormatFromPath(const std::string &path);
+
+// Writes an image one row at a time in file order, so only the row being
+// written has to exist. 8-bit pixels are packed as 0x00BBGGRR.
+class ImageWriter
+{
+public:
+    ImageWriter();
+    ~ImageWriter();
+
+    bool open(const std::string &path, ImageFormat format, int width, int height);
+    // false for BMP and PFM: the first row of the file is the bottom one
+    bool topDown() const { return format != IMAGE_BMP && format != IMAGE_PFM; }
+    bool isFloat() const { return format == IMAGE_PFM; }
+    void writeRow(const unsigned int *pixels);
+    // a row of a float image, one plane per channel
+    void writeRow(const float *r, const float *g, const float *b);
+    // false if the file could not be written completely
+    bool close();
+
+private:
+    FILE *file;
+    ImageFormat format;
+    int width, height, rows;
+    std::vector<unsigned char> line;
+    std::vector<float> floatLine;
+    // zlib stream of the PNG, flushed as IDAT chunks
+    std::vector<unsigned char> idat;
+    uint32_t adler;
+
+    void deflateStored(const unsigned char *data, size_t size);
+    void flushIDAT();
+    void writeChunk(const char *type, const unsigned char *data, size_t size);
+};
+
+// Converts n float pixels given as three planes to packed 8-bit ones.
+typedef std::function<void(const float *, const float *, const float *, unsigned int *, size_t)> Quantizer;
+
+// Float frame output in strips of rows that finish in any order. At most
+// `slots` strips are held; a dedicated thread quantizes and writes them in
+// file order while the remaining ones are rendered. Strip 0 is the first
+// one of the file.
+class StripWriter
+{
+public:
+    bool open(const std::string &path, ImageFormat format, int width, int height, int stripHeight, int slots, const Quantizer &quantize);
+
+    int stripCount() const { return strips; }
+    bool topDown() const { return writer.topDown(); }
+    // image rows [y0, y1) of strip s
+    void stripRows(int s, int &y0, int &y1) const;
+    // strip holding image row y
+    int stripOf(int y) const;
+    // Red plane of strip s, row y0 first; green and blue follow at
+    // planeSize() floats each. Blocks while the writer still needs the
+    // buffer for an earlier strip.
+    float *acquire(int s);
+    size_t planeSize() const { return (size_t)stripHeight * width; }
+    // `pixels` more pixels of strip s are final
+    void done(int s, size_t pixels);
+    // waits for the last strip to be written
+    bool close();
+
+    size_t memoryUsage() const { return buffer.capacity() * sizeof(float) + packed.capacity() * sizeof(unsigned int); }
+    // time the writer thread spent quantizing
+    double quantizeMs() const { return quantizeTime; }
+
+private:
+    ImageWriter writer;
+    int width, height, stripHeight, slots, strips;
+    Quantizer quantize;
+    std::vector<float> buffer;
+    std::vector<unsigned int> packed; // one quantized strip
+    double quantizeTime;
+    std::vector<int> owner;        // strip in each slot, -1 when free
+    std::vector<size_t> remaining; // pixels of that strip still being rendered
+    int written;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread io;
+
+    void writeStrips();
+};
+
+// Part of a float frame rendered by one process of a split render, read
+// back by rt_merge. After the "RTPART 2\n" magic come the frame width,
+// height and rectangle count as uint32 and the frame hash as uint64, then
+// per rectangle x0 y0 x1 y1 (uint32, half-open, y counted from the bottom
+// row as in the renderer) and its red, green and blue float planes. All
+// numbers are little-endian, whatever machine wrote them. The hash stands
+// for the scene and the settings the pixels depend on (see frame_hash);
+// parts that disagree on it come from different renders.
+class PartialWriter
+{
+public:
+    PartialWriter() : file(NULL), rects(0) {}
+    ~PartialWriter();
+
+    bool open(const std::string &path, int width, int height, uint64_t frameHash);
+    // r, g and b point at pixel (x0, y0); rows are `stride` floats apart
+    void writeRect(int x0, int y0, int x1, int y1, const float *r, const float *g, const float *b, size_t stride);
+    // writes the rectangle count; false if the file is incomplete
+    bool close();
+
+private:
+    FILE *file;
+    uint32_t rects;
+    std::vector<unsigned char> bytes;
+};
+
+// Adds the rectangles of a partial file to full-frame planes r, g, b and
+// bumps `coverage` for every pixel written. The planes are sized on the
+// first file (width == 0); later files must have the same frame size.
+// `frameHash` receives the hash of this file for the caller to compare.
+bool readPartialImage(const std::string &path, int &width, int &height, uint64_t &frameHash, std::vector<float> &r, std::vector<float> &g, std::vector<float> &b, std::vector<unsigned char> &coverage, std::string &error);
+
+#endif
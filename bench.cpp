@@ -0,0 +1,295 @@
+// rt_bench: microbenchmarks of the intersection and shading kernels and
+// end-to-end renders of scenes 1-3 and generated scenes over a thread
+// sweep. Results go to stdout (or -out) as JSON or CSV; progress to stderr.
+//
+//   rt_bench [-only micro|render] [-runs 5] [-threads 1,2,4] [-scenes 1,2,3]
+//            [-counts 10000,100000] [-format json|csv] [-out file]
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "lib/stb/stb_image.h"
+
+#include "renderer.h"
+
+struct BenchResult
+{
+  std::string group; // micro or render
+  std::string name;
+  int threads;
+  std::vector<double> ms; // wall time of each run
+  uint64_t count;         // calls or rays per run
+
+  double minMs() const { return *std::min_element(ms.begin(), ms.end()); }
+  double medianMs() const
+  {
+    std::vector<double> sorted(ms);
+    std::sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  }
+  double nsPerOp() const { return medianMs() * 1e6 / std::max<uint64_t>(1, count); }
+  double opsPerSecond() const { return count / (medianMs() / 1000); }
+};
+
+std::vector<std::string> split_list(const std::string &list)
+{
+  std::vector<std::string> items;
+  std::stringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the benchmarked results alive
+volatile float benchSink;
+
+// `body(i)` for i in [0, calls), timed `runs` times after one warm-up pass
+template <typename Body>
+BenchResult time_calls(const std::string &name, uint64_t calls, int runs, Body body)
+{
+  BenchResult r;
+  r.group = "micro";
+  r.name = name;
+  r.threads = 1;
+  r.count = calls;
+  float sink = 0;
+  for (int run = -1; run < runs; run++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < calls; i++)
+      sink += body(i);
+    if (run >= 0)
+      r.ms.push_back(elapsed_ms(start));
+  }
+  benchSink = sink;
+  std::cerr << "  " << name << ": " << r.nsPerOp() << " ns" << std::endl;
+  return r;
+}
+
+void run_micro(int runs, std::vector<BenchResult> &results)
+{
+  const int RAYS = 4096;        // about half of them hit each primitive
+  const uint64_t CALLS = 1 << 22;
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> spread(-1.5f, 1.5f);
+  std::vector<Vec3f> dirs(RAYS), normals(RAYS);
+  for (int i = 0; i < RAYS; i++)
+  {
+    dirs[i] = normalize(Vec3f(spread(gen), spread(gen), -5));
+    normals[i] = normalize(Vec3f(spread(gen), spread(gen), spread(gen)));
+  }
+  const Vec3f orig(0, 0, 0);
+
+  std::vector<std::pair<std::string, std::unique_ptr<Object>>> objects;
+  objects.push_back(std::make_pair("Sphere", std::unique_ptr<Object>(new Sphere(Vec3f(0, 0, -5), 1, 0))));
+  objects.push_back(std::make_pair("Triangle", std::unique_ptr<Object>(new Triangle(Vec3f(-1, -1, -5), Vec3f(1, -1, -5), Vec3f(0, 1, -5), 0))));
+  objects.push_back(std::make_pair("Cone", std::unique_ptr<Object>(new Cone(Vec3f(0, -1, -5), 1, 2, 0))));
+  objects.push_back(std::make_pair("Cylinder", std::unique_ptr<Object>(new Cylinder(Vec3f(0, -1, -5), 1, 2, 0))));
+  objects.push_back(std::make_pair("Plane", std::unique_ptr<Object>(new Plane(Vec3f(0, -1, 0), Vec3f(0, 1, 0), 0))));
+  // oriented ones: upright like the two above, then tilted
+  Transform upright = Transform::alongAxis(Vec3f(0, -1, -5), Vec3f(0, 1, 0)), tilted = Transform::alongAxis(Vec3f(0, -1, -5), Vec3f(1, 2, 0.5));
+  objects.push_back(std::make_pair("OrientedCone", std::unique_ptr<Object>(new OrientedCone(upright, 1, 2, 0))));
+  objects.push_back(std::make_pair("OrientedCylinder", std::unique_ptr<Object>(new OrientedCylinder(upright, 1, 2, 0))));
+  objects.push_back(std::make_pair("OrientedCylinder tilted", std::unique_ptr<Object>(new OrientedCylinder(tilted, 1, 2, 0))));
+  objects.push_back(std::make_pair("Capsule", std::unique_ptr<Object>(new Capsule(tilted, 0.8f, 1.5f, 0))));
+  objects.push_back(std::make_pair("Disk", std::unique_ptr<Object>(new Disk(Transform::alongAxis(Vec3f(0, 0, -5), Vec3f(0.3f, 0.2f, 1)), 1, 0))));
+  for (size_t k = 0; k < objects.size(); k++)
+  {
+    const Object &object = *objects[k].second;
+    results.push_back(time_calls(objects[k].first + "::intersection", CALLS, runs, [&](uint64_t i) {
+      HitRecord hit;
+      return object.intersection(orig, dirs[i % RAYS], hit) ? hit.t : 0.f;
+    }));
+  }
+
+  results.push_back(time_calls("fresnel", CALLS, runs, [&](uint64_t i) {
+    float kr;
+    fresnel(dirs[i % RAYS], normals[i % RAYS], 1.5f, kr);
+    return kr;
+  }));
+  results.push_back(time_calls("refract", CALLS, runs, [&](uint64_t i) { return refract(dirs[i % RAYS], normals[i % RAYS], 1.5f).x; }));
+  results.push_back(time_calls("reflect", CALLS, runs, [&](uint64_t i) { return reflect(dirs[i % RAYS], normals[i % RAYS]).x; }));
+
+  // a synthetic 2:1 lat-long image, no file needed
+  const int W = 1024, H = 512;
+  std::vector<unsigned char> rgb(3 * W * H);
+  for (size_t k = 0; k < rgb.size(); k++)
+    rgb[k] = (unsigned char)(k * 31 % 251);
+  struct EnvCase
+  {
+    const char *name;
+    EnvLayout layout;
+    bool bilinear;
+  } cases[] = {{"envmap.lookup latlong", ENV_LATLONG, false},
+               {"envmap.lookup latlong bilinear", ENV_LATLONG, true},
+               {"envmap.lookup octahedral", ENV_OCTAHEDRAL, false},
+               {"envmap.lookup octahedral bilinear", ENV_OCTAHEDRAL, true}};
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+    EnvironmentMap envmap;
+    envmap.build(rgb.data(), W, H, cases[c].layout, cases[c].bilinear);
+    results.push_back(time_calls(cases[c].name, CALLS, runs, [&](uint64_t i) { return envmap.lookup(normals[i % RAYS]).x; }));
+  }
+}
+
+// Parses and builds `scene` once, then renders it `runs` times at every
+// thread count.
+bool run_scene(const std::string &label, const std::string &scene, long count, const std::vector<int> &threadCounts, int runs,
+               std::vector<BenchResult> &results)
+{
+  Scene sc;
+  SceneOptions options;
+  SceneParser parser(sc, options, count);
+  if (!parser.load(scene_path(scene)))
+    return false;
+  Settings settings = default_settings();
+  apply_scene_options(options, settings);
+  EnvironmentMap envmap;
+  if (settings.envmap_ineed && !load_envmap(options.envmap, ENV_LATLONG, false, envmap))
+    return false;
+  auto buildStart = std::chrono::steady_clock::now();
+  sc.build();
+  std::cerr << "  " << label << ": " << sc.objects.size() << " objects, build " << elapsed_ms(buildStart) << " ms" << std::endl;
+
+  std::vector<float> image(3 * (size_t)settings.width * settings.height);
+  FrameContext frame = make_frame(sc, envmap, settings, options.camera, image.data());
+  const int tileSize = 16;
+  std::vector<TilePixel> pixelOrder = tilePixelOrder(tileSize, ORDER_MORTON);
+  for (size_t t = 0; t < threadCounts.size(); t++)
+  {
+    ThreadPool pool(threadCounts[t]);
+    TileScheduler scheduler;
+    BenchResult r;
+    r.group = "render";
+    r.name = label;
+    r.threads = pool.size();
+    for (int run = 0; run < runs; run++)
+    {
+      scheduler.reset(settings.width, settings.height, tileSize, pool.size());
+      FrameStats stats = render_frame(frame, pool, scheduler, pixelOrder, nullptr);
+      r.ms.push_back(stats.wall);
+      r.count = stats.counters.intersectCalls + stats.counters.occludedCalls;
+    }
+    std::cerr << "  " << label << " x" << r.threads << ": median " << r.medianMs() << " ms, " << r.opsPerSecond() / 1e6 << " Mrays/s" << std::endl;
+    results.push_back(r);
+  }
+  return true;
+}
+
+void write_json(std::ostream &out, const std::vector<BenchResult> &results, int runs)
+{
+  SimdLevel simd = detectSimd();
+  out << "{\n  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n  \"simd\": \"" << simdName(simd)
+      << "\",\n  \"runs\": " << runs << ",\n  \"results\": [\n";
+  for (size_t k = 0; k < results.size(); k++)
+  {
+    const BenchResult &r = results[k];
+    bool render = r.group == "render";
+    out << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\", \"threads\": " << r.threads << ", \""
+        << (render ? "rays" : "calls") << "\": " << r.count << ", \"min_ms\": " << r.minMs() << ", \"median_ms\": " << r.medianMs() << ", \""
+        << (render ? "ns_per_ray" : "ns_per_call") << "\": " << r.nsPerOp() << ", \"" << (render ? "rays_per_s" : "calls_per_s")
+        << "\": " << r.opsPerSecond() << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+void write_csv(std::ostream &out, const std::vector<BenchResult> &results)
+{
+  out << "group,name,threads,count,min_ms,median_ms,ns_per_op,ops_per_s\n";
+  for (size_t k = 0; k < results.size(); k++)
+  {
+    const BenchResult &r = results[k];
+    out << r.group << ",\"" << r.name << "\"," << r.threads << "," << r.count << "," << r.minMs() << "," << r.medianMs() << ","
+        << r.nsPerOp() << "," << r.opsPerSecond() << "\n";
+  }
+}
+
+int main(int argc, const char **argv)
+{
+  std::unordered_map<std::string, std::string> cmdLineParams;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string key(argv[i]);
+    if (key.size() > 0 && key[0] == '-')
+      cmdLineParams[key] = i + 1 < argc ? argv[++i] : "";
+  }
+
+  std::string only = cmdLineParams.count("-only") ? cmdLineParams["-only"] : "";
+  int runs = cmdLineParams.count("-runs") ? std::max(1, atoi(cmdLineParams["-runs"].c_str())) : 5;
+
+  std::vector<int> threadCounts;
+  if (cmdLineParams.count("-threads"))
+  {
+    std::vector<std::string> items = split_list(cmdLineParams["-threads"]);
+    for (size_t k = 0; k < items.size(); k++)
+      threadCounts.push_back(std::max(1, atoi(items[k].c_str())));
+  }
+  else
+  {
+    int hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t < hardware; t *= 2)
+      threadCounts.push_back(t);
+    threadCounts.push_back(hardware);
+  }
+  std::vector<std::string> scenes = split_list(cmdLineParams.count("-scenes") ? cmdLineParams["-scenes"] : "1,2,3");
+  std::vector<std::string> counts = split_list(cmdLineParams.count("-counts") ? cmdLineParams["-counts"] : "10000,100000");
+  for (size_t k = 0; k < counts.size(); k++)
+  {
+    if (atol(counts[k].c_str()) < 0)
+    {
+      std::cerr << "Error: -counts needs 0 or more, got '" << counts[k] << "'" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<BenchResult> results;
+  if (only.empty() || only == "micro")
+  {
+    std::cerr << "micro:" << std::endl;
+    run_micro(runs, results);
+  }
+  if (only.empty() || only == "render")
+  {
+    std::cerr << "render:" << std::endl;
+    for (size_t k = 0; k < scenes.size(); k++)
+      if (!run_scene("scene" + scenes[k], scenes[k], -1, threadCounts, runs, results))
+        return 1;
+    // scenes 4 and 5 generate spheres and triangles
+    for (size_t k = 0; k < counts.size(); k++)
+    {
+      long count = atol(counts[k].c_str());
+      if (!run_scene("spheres" + counts[k], "4", count, threadCounts, runs, results) ||
+          !run_scene("triangles" + counts[k], "5", count, threadCounts, runs, results))
+        return 1;
+    }
+  }
+
+  std::ofstream file;
+  if (cmdLineParams.count("-out"))
+  {
+    file.open(cmdLineParams["-out"].c_str());
+    if (!file)
+    {
+      std::cerr << "Error: cannot write " << cmdLineParams["-out"] << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &out = file.is_open() ? file : std::cout;
+  if (cmdLineParams.count("-format") && cmdLineParams["-format"] == "csv")
+    write_csv(out, results);
+  else
+    write_json(out, results, runs);
+  return 0;
+}
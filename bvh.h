@@ -0,0 +1,332 @@
+#ifndef BVH_h
+#define BVH_h
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "vectors.h"
+#include "objects.h"
+
+struct BVHNode
+{
+    AABB box;
+    uint32_t first; // left child for inner nodes, first index for leaves
+    uint32_t count; // 0 for inner nodes
+};
+
+// Binned SAH bounding volume hierarchy. It only knows about boxes: the
+// caller keeps the primitives and `indices` maps leaf slots back to them.
+class BVH
+{
+public:
+    static const int MAX_PACKET = 32;
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;
+
+    // leafWidth > 1 prices leaves per batch of primitives (SIMD leaves of
+    // that width cost the same whether they hold one primitive or all)
+    void build(const std::vector<AABB> &boxes, uint32_t maxLeafSize = 4, uint32_t leafWidth = 1)
+    {
+        nodes.clear();
+        indices.resize(boxes.size());
+        if (boxes.empty())
+            return;
+
+        centroids.resize(boxes.size());
+        for (uint32_t i = 0; i < boxes.size(); i++)
+        {
+            indices[i] = i;
+            centroids[i] = boxes[i].centroid();
+        }
+
+        nodes.reserve(boxes.size() * 2);
+        BVHNode root;
+        root.first = 0;
+        root.count = (uint32_t)boxes.size();
+        nodes.push_back(root);
+        subdivide(0, boxes, maxLeafSize, leafWidth, 0);
+        nodes.shrink_to_fit(); // the reserve above is the worst case
+
+        centroids.clear();
+        centroids.shrink_to_fit();
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Same tree over moved primitives: leaves take the union of box(index)
+    // over their slots, inner nodes that of their children. Children are
+    // always stored after their parent, so one backward pass does it.
+    template <typename BoxFn>
+    void refit(BoxFn box)
+    {
+        for (size_t n = nodes.size(); n-- > 0;)
+        {
+            BVHNode &node = nodes[n];
+            AABB b;
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.first; k < node.first + node.count; k++)
+                    b.expand(box(indices[k]));
+            }
+            else
+            {
+                b.expand(nodes[node.first].box);
+                b.expand(nodes[node.first + 1].box);
+            }
+            node.box = b;
+        }
+    }
+
+    // Front-to-back traversal. `leaf(index, tmax)` tests one primitive and
+    // may shrink tmax (closest hit); returning true ends the walk (any hit).
+    template <typename LeafFn>
+    bool traverse(const Vec3f &orig, const Vec3f &dir, float &tmax, LeafFn leaf) const
+    {
+        if (nodes.empty())
+            return false;
+
+        Vec3f invDir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+        uint32_t stack[128];
+        int sp = 0;
+
+        float tbox;
+        if (!nodes[0].box.intersect(orig, invDir, tmax, tbox))
+            return false;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const BVHNode &node = nodes[stack[--sp]];
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.first; k < node.first + node.count; k++)
+                {
+                    if (leaf(indices[k], tmax))
+                        return true;
+                }
+                continue;
+            }
+
+            float tl, tr;
+            bool hl = nodes[node.first].box.intersect(orig, invDir, tmax, tl);
+            bool hr = nodes[node.first + 1].box.intersect(orig, invDir, tmax, tr);
+            if (hl && hr)
+            {
+                // push the far child first so the near one is popped next
+                if (tl <= tr)
+                {
+                    stack[sp++] = node.first + 1;
+                    stack[sp++] = node.first;
+                }
+                else
+                {
+                    stack[sp++] = node.first;
+                    stack[sp++] = node.first + 1;
+                }
+            }
+            else if (hl)
+                stack[sp++] = node.first;
+            else if (hr)
+                stack[sp++] = node.first + 1;
+        }
+        return false;
+    }
+
+    // Packet traversal for up to MAX_PACKET rays sharing an origin. A node is
+    // visited while any ray of the packet overlaps it; `leaf(index, mask, tmax)`
+    // gets the bitmask of those rays and may shrink their tmax entries.
+    template <typename LeafFn>
+    void traversePacket(const Vec3f &orig, const Vec3f *dir, int n, float *tmax, LeafFn leaf) const
+    {
+        if (nodes.empty() || n <= 0)
+            return;
+
+        Vec3f invDir[MAX_PACKET];
+        for (int r = 0; r < n; r++)
+            invDir[r] = Vec3f(1 / dir[r].x, 1 / dir[r].y, 1 / dir[r].z);
+
+        uint32_t stackNode[128], stackMask[128];
+        int sp = 0;
+
+        float tbox;
+        uint32_t all = (n == 32) ? 0xFFFFFFFFu : ((1u << n) - 1);
+        uint32_t rootMask = packetMask(nodes[0].box, orig, invDir, all, tmax, tbox);
+        if (!rootMask)
+            return;
+        stackNode[sp] = 0;
+        stackMask[sp++] = rootMask;
+
+        while (sp > 0)
+        {
+            --sp;
+            const BVHNode &node = nodes[stackNode[sp]];
+            uint32_t mask = stackMask[sp];
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.first; k < node.first + node.count; k++)
+                    leaf(indices[k], mask, tmax);
+                continue;
+            }
+
+            float tl, tr;
+            uint32_t ml = packetMask(nodes[node.first].box, orig, invDir, mask, tmax, tl);
+            uint32_t mr = packetMask(nodes[node.first + 1].box, orig, invDir, mask, tmax, tr);
+            bool leftFirst = tl <= tr;
+            if (ml && mr)
+            {
+                stackNode[sp] = leftFirst ? node.first + 1 : node.first;
+                stackMask[sp++] = leftFirst ? mr : ml;
+                stackNode[sp] = leftFirst ? node.first : node.first + 1;
+                stackMask[sp++] = leftFirst ? ml : mr;
+            }
+            else if (ml || mr)
+            {
+                stackNode[sp] = ml ? node.first : node.first + 1;
+                stackMask[sp++] = ml ? ml : mr;
+            }
+        }
+    }
+
+private:
+    static const int BINS = 16;
+    // past this depth splits fall back to the object median, which keeps
+    // the tree shallow enough for the fixed traversal stack
+    static const int MAX_SAH_DEPTH = 48;
+
+    std::vector<Vec3f> centroids;
+
+    // rays of `mask` overlapping the box; tnear is the smallest entry distance
+    static uint32_t packetMask(const AABB &box, const Vec3f &orig, const Vec3f *invDir, uint32_t mask, const float *tmax, float &tnear)
+    {
+        uint32_t hit = 0;
+        tnear = std::numeric_limits<float>::max();
+        for (int r = 0; r < MAX_PACKET && (mask >> r); r++)
+        {
+            float t;
+            if ((mask >> r & 1) && box.intersect(orig, invDir[r], tmax[r], t))
+            {
+                hit |= 1u << r;
+                tnear = std::min(tnear, t);
+            }
+        }
+        return hit;
+    }
+
+    static float batches(uint32_t n, uint32_t width) { return (float)((n + width - 1) / width); }
+
+    void subdivide(uint32_t nodeIdx, const std::vector<AABB> &boxes, uint32_t maxLeafSize, uint32_t leafWidth, int depth)
+    {
+        uint32_t first = nodes[nodeIdx].first;
+        uint32_t count = nodes[nodeIdx].count;
+
+        AABB box, cbox;
+        for (uint32_t k = first; k < first + count; k++)
+        {
+            box.expand(boxes[indices[k]]);
+            cbox.expand(centroids[indices[k]]);
+        }
+        nodes[nodeIdx].box = box;
+
+        if (count <= 1)
+            return;
+
+        int axis = -1;
+        float splitPos = 0;
+        float bestCost = std::numeric_limits<float>::max();
+
+        if (depth < MAX_SAH_DEPTH)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                float lo = cbox.min[a], hi = cbox.max[a];
+                if (hi <= lo)
+                    continue;
+
+                AABB binBox[BINS];
+                uint32_t binCount[BINS] = {0};
+                float scale = BINS / (hi - lo);
+                for (uint32_t k = first; k < first + count; k++)
+                {
+                    int b = std::min(BINS - 1, (int)((centroids[indices[k]][a] - lo) * scale));
+                    binCount[b]++;
+                    binBox[b].expand(boxes[indices[k]]);
+                }
+
+                // sweep from the right to get the area/count of every right side
+                float rightArea[BINS - 1];
+                uint32_t rightCount[BINS - 1];
+                AABB acc;
+                uint32_t n = 0;
+                for (int b = BINS - 1; b > 0; b--)
+                {
+                    acc.expand(binBox[b]);
+                    n += binCount[b];
+                    rightArea[b - 1] = acc.surfaceArea();
+                    rightCount[b - 1] = n;
+                }
+
+                acc = AABB();
+                n = 0;
+                for (int b = 0; b < BINS - 1; b++)
+                {
+                    acc.expand(binBox[b]);
+                    n += binCount[b];
+                    if (n == 0 || rightCount[b] == 0)
+                        continue;
+                    float cost = batches(n, leafWidth) * acc.surfaceArea() + batches(rightCount[b], leafWidth) * rightArea[b];
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        axis = a;
+                        splitPos = lo + (b + 1) / scale;
+                    }
+                }
+            }
+
+            // SAH leaf test: traversal cost 1, intersection cost 1 per batch of leafWidth primitives
+            float leafCost = batches(count, leafWidth);
+            float area = box.surfaceArea();
+            if (count <= maxLeafSize && (axis < 0 || area <= 0 || 1 + bestCost / area >= leafCost))
+                return;
+        }
+        else if (count <= maxLeafSize)
+            return;
+
+        uint32_t mid;
+        if (axis >= 0)
+        {
+            uint32_t *begin = &indices[first];
+            uint32_t *split = std::partition(begin, begin + count, [&](uint32_t idx) { return centroids[idx][axis] < splitPos; });
+            mid = first + (uint32_t)(split - begin);
+        }
+        else
+        {
+            // degenerate centroids or depth limit: object median on the widest axis
+            Vec3f ext = cbox.max - cbox.min;
+            int a = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+            mid = first + count / 2;
+            std::nth_element(indices.begin() + first, indices.begin() + mid, indices.begin() + first + count,
+                             [&](uint32_t l, uint32_t r) { return centroids[l][a] < centroids[r][a]; });
+        }
+        if (mid == first || mid == first + count)
+            mid = first + count / 2;
+
+        uint32_t left = (uint32_t)nodes.size();
+        BVHNode l, r;
+        l.first = first;
+        l.count = mid - first;
+        r.first = mid;
+        r.count = first + count - mid;
+        nodes.push_back(l);
+        nodes.push_back(r);
+        nodes[nodeIdx].first = left;
+        nodes[nodeIdx].count = 0;
+
+        subdivide(left, boxes, maxLeafSize, leafWidth, depth + 1);
+        subdivide(left + 1, boxes, maxLeafSize, leafWidth, depth + 1);
+    }
+};
+
+#endif
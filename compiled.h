@@ -0,0 +1,221 @@
+#ifndef Compiled_h
+#define Compiled_h
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+
+// Structure-of-arrays copies of the scene primitives, one contiguous store
+// per type. Built from the Object list, which stays the authoring API;
+// `object` maps every entry back to its Object for getData.
+struct SphereSoA
+{
+    std::vector<float> cx, cy, cz, radius;
+    std::vector<uint32_t> object;
+};
+
+struct TriangleSoA
+{
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> v1x, v1y, v1z;
+    std::vector<float> v2x, v2y, v2z;
+    std::vector<uint32_t> object;
+};
+
+// cones and cylinders share the Y-axis parametrisation
+struct QuadricSoA
+{
+    std::vector<float> cx, cy, cz, radius, height;
+    std::vector<uint32_t> object;
+};
+
+struct PlaneSoA
+{
+    std::vector<float> px, py, pz, nx, ny, nz;
+    std::vector<uint32_t> object;
+};
+
+class CompiledScene
+{
+public:
+    SphereSoA spheres;
+    TriangleSoA triangles;
+    QuadricSoA cones;
+    QuadricSoA cylinders;
+    PlaneSoA planes;
+    std::vector<uint32_t> others; // types without a store, tested virtually
+
+    void build(const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        *this = CompiledScene();
+        for (uint32_t i = 0; i < objects.size(); i++)
+        {
+            const Object *obj = objects[i].get();
+            if (const Sphere *sp = dynamic_cast<const Sphere *>(obj))
+            {
+                spheres.cx.push_back(sp->center.x);
+                spheres.cy.push_back(sp->center.y);
+                spheres.cz.push_back(sp->center.z);
+                spheres.radius.push_back(sp->radius);
+                spheres.object.push_back(i);
+            }
+            else if (const Triangle *tr = dynamic_cast<const Triangle *>(obj))
+            {
+                triangles.v0x.push_back(tr->v0.x);
+                triangles.v0y.push_back(tr->v0.y);
+                triangles.v0z.push_back(tr->v0.z);
+                triangles.v1x.push_back(tr->v1.x);
+                triangles.v1y.push_back(tr->v1.y);
+                triangles.v1z.push_back(tr->v1.z);
+                triangles.v2x.push_back(tr->v2.x);
+                triangles.v2y.push_back(tr->v2.y);
+                triangles.v2z.push_back(tr->v2.z);
+                triangles.object.push_back(i);
+            }
+            else if (const Cone *co = dynamic_cast<const Cone *>(obj))
+                addQuadric(cones, co->center, co->radius, co->height, i);
+            else if (const Cylinder *cy = dynamic_cast<const Cylinder *>(obj))
+                addQuadric(cylinders, cy->center, cy->radius, cy->height, i);
+            else if (const Plane *pl = dynamic_cast<const Plane *>(obj))
+            {
+                planes.px.push_back(pl->v0.x);
+                planes.py.push_back(pl->v0.y);
+                planes.pz.push_back(pl->v0.z);
+                planes.nx.push_back(pl->n.x);
+                planes.ny.push_back(pl->n.y);
+                planes.nz.push_back(pl->n.z);
+                planes.object.push_back(i);
+            }
+            else
+                others.push_back(i);
+        }
+    }
+
+    // Closest hit, type by type. `closer` counts how often the record improved.
+    void intersect(const Vec3f &orig, const Vec3f &dir, const std::vector<std::unique_ptr<Object>> &objects, HitRecord &hit, uint64_t &closer) const
+    {
+        float t, u, v;
+        for (size_t k = 0; k < spheres.object.size(); k++)
+        {
+            if (Sphere::intersect(Vec3f(spheres.cx[k], spheres.cy[k], spheres.cz[k]), spheres.radius[k], orig, dir, t) && t < hit.t)
+            {
+                hit.t = t;
+                hit.index = spheres.object[k];
+                closer++;
+            }
+        }
+        for (size_t k = 0; k < triangles.object.size(); k++)
+        {
+            if (Triangle::intersect(Vec3f(triangles.v0x[k], triangles.v0y[k], triangles.v0z[k]),
+                                    Vec3f(triangles.v1x[k], triangles.v1y[k], triangles.v1z[k]),
+                                    Vec3f(triangles.v2x[k], triangles.v2y[k], triangles.v2z[k]), orig, dir, t, u, v) &&
+                t < hit.t)
+            {
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.index = triangles.object[k];
+                closer++;
+            }
+        }
+        for (size_t k = 0; k < cones.object.size(); k++)
+        {
+            if (Cone::intersect(Vec3f(cones.cx[k], cones.cy[k], cones.cz[k]), cones.radius[k], cones.height[k], orig, dir, t) && t < hit.t)
+            {
+                hit.t = t;
+                hit.index = cones.object[k];
+                closer++;
+            }
+        }
+        for (size_t k = 0; k < cylinders.object.size(); k++)
+        {
+            if (Cylinder::intersect(Vec3f(cylinders.cx[k], cylinders.cy[k], cylinders.cz[k]), cylinders.radius[k], cylinders.height[k], orig, dir, t) && t < hit.t)
+            {
+                hit.t = t;
+                hit.index = cylinders.object[k];
+                closer++;
+            }
+        }
+        for (size_t k = 0; k < planes.object.size(); k++)
+        {
+            if (Plane::intersect(Vec3f(planes.px[k], planes.py[k], planes.pz[k]), Vec3f(planes.nx[k], planes.ny[k], planes.nz[k]), orig, dir, t) && t < hit.t)
+            {
+                hit.t = t;
+                hit.index = planes.object[k];
+                closer++;
+            }
+        }
+        HitRecord h;
+        for (size_t k = 0; k < others.size(); k++)
+        {
+            if (objects[others[k]]->intersection(orig, dir, h) && h.t < hit.t)
+            {
+                hit = h;
+                hit.index = others[k];
+                closer++;
+            }
+        }
+    }
+
+    // `occluder` receives the object found in the way
+    bool occluded(const Vec3f &orig, const Vec3f &dir, const float &tmax, const std::vector<std::unique_ptr<Object>> &objects, uint32_t &occluder) const
+    {
+        float t, u, v;
+        for (size_t k = 0; k < spheres.object.size(); k++)
+            if (Sphere::intersect(Vec3f(spheres.cx[k], spheres.cy[k], spheres.cz[k]), spheres.radius[k], orig, dir, t) && t < tmax)
+            {
+                occluder = spheres.object[k];
+                return true;
+            }
+        for (size_t k = 0; k < triangles.object.size(); k++)
+            if (Triangle::intersect(Vec3f(triangles.v0x[k], triangles.v0y[k], triangles.v0z[k]),
+                                    Vec3f(triangles.v1x[k], triangles.v1y[k], triangles.v1z[k]),
+                                    Vec3f(triangles.v2x[k], triangles.v2y[k], triangles.v2z[k]), orig, dir, t, u, v) &&
+                t < tmax)
+            {
+                occluder = triangles.object[k];
+                return true;
+            }
+        for (size_t k = 0; k < cones.object.size(); k++)
+            if (Cone::intersect(Vec3f(cones.cx[k], cones.cy[k], cones.cz[k]), cones.radius[k], cones.height[k], orig, dir, t) && t < tmax)
+            {
+                occluder = cones.object[k];
+                return true;
+            }
+        for (size_t k = 0; k < cylinders.object.size(); k++)
+            if (Cylinder::intersect(Vec3f(cylinders.cx[k], cylinders.cy[k], cylinders.cz[k]), cylinders.radius[k], cylinders.height[k], orig, dir, t) && t < tmax)
+            {
+                occluder = cylinders.object[k];
+                return true;
+            }
+        for (size_t k = 0; k < planes.object.size(); k++)
+            if (Plane::intersect(Vec3f(planes.px[k], planes.py[k], planes.pz[k]), Vec3f(planes.nx[k], planes.ny[k], planes.nz[k]), orig, dir, t) && t < tmax)
+            {
+                occluder = planes.object[k];
+                return true;
+            }
+        for (size_t k = 0; k < others.size(); k++)
+            if (objects[others[k]]->occluded(orig, dir, tmax))
+            {
+                occluder = others[k];
+                return true;
+            }
+        return false;
+    }
+
+private:
+    static void addQuadric(QuadricSoA &store, const Vec3f &center, const float &radius, const float &height, uint32_t object)
+    {
+        store.cx.push_back(center.x);
+        store.cy.push_back(center.y);
+        store.cz.push_back(center.z);
+        store.radius.push_back(radius);
+        store.height.push_back(height);
+        store.object.push_back(object);
+    }
+};
+
+#endif
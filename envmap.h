@@ -0,0 +1,144 @@
+#ifndef EnvMap_h
+#define EnvMap_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vectors.h"
+#include "functions.h"
+
+enum EnvLayout
+{
+    ENV_LATLONG,   // the layout of the envmap*.jpg files, one atan2/acos per lookup
+    ENV_OCTAHEDRAL // resampled at load, lookups are a few adds and one divide
+};
+
+EnvLayout parseEnvLayout(const std::string &name)
+{
+    return name == "octahedral" ? ENV_OCTAHEDRAL : ENV_LATLONG;
+}
+
+// Radiance at infinity looked up by direction alone. Texels are RGB8,
+// a quarter of the Vec3f storage the image used to be converted to.
+class EnvironmentMap
+{
+public:
+    EnvironmentMap() : width(0), height(0), layout(ENV_LATLONG), bilinear(false) {}
+
+    bool empty() const { return texels.empty(); }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    EnvLayout getLayout() const { return layout; }
+    size_t memoryUsage() const { return texels.capacity() * sizeof(Texel); }
+
+    // `rgb` holds a width x height lat-long image, 3 bytes per texel
+    void build(const unsigned char *rgb, int w, int h, EnvLayout target, bool filter)
+    {
+        width = w;
+        height = h;
+        layout = ENV_LATLONG;
+        bilinear = filter;
+        texels.resize((size_t)w * h);
+        for (size_t k = 0; k < texels.size(); k++)
+        {
+            texels[k].r = rgb[3 * k];
+            texels[k].g = rgb[3 * k + 1];
+            texels[k].b = rgb[3 * k + 2];
+        }
+        if (target == ENV_OCTAHEDRAL)
+            toOctahedral();
+    }
+
+    Vec3f lookup(const Vec3f &dir) const
+    {
+        float x, y;
+        if (layout == ENV_OCTAHEDRAL)
+        {
+            float s = std::fabs(dir.x) + std::fabs(dir.y) + std::fabs(dir.z);
+            float u = dir.x / s, v = dir.z / s;
+            if (dir.y < 0)
+            {
+                float fu = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+                float fv = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+                u = fu;
+                v = fv;
+            }
+            x = (u * 0.5f + 0.5f) * width;
+            y = (v * 0.5f + 0.5f) * height;
+        }
+        else
+        {
+            x = (atan2(dir.z, dir.x) / (-2 * M_PI) + .5) * width;
+            y = acos(std::max(-1.f, std::min(1.f, dir.y))) / M_PI * height;
+        }
+        return bilinear ? sampleBilinear(x, y) : fetch((int)x, (int)y);
+    }
+
+private:
+    struct Texel
+    {
+        uint8_t r, g, b;
+    };
+    std::vector<Texel> texels;
+    int width, height;
+    EnvLayout layout;
+    bool bilinear;
+
+    // clamped in y; lat-long wraps around in x
+    Vec3f fetch(int x, int y) const
+    {
+        if (layout == ENV_LATLONG)
+            x = ((x % width) + width) % width;
+        else
+            x = std::max(0, std::min(width - 1, x));
+        y = std::max(0, std::min(height - 1, y));
+        const Texel &t = texels[x + (size_t)y * width];
+        return Vec3f(t.r, t.g, t.b) * (1 / 255.);
+    }
+
+    Vec3f sampleBilinear(float x, float y) const
+    {
+        x -= 0.5f;
+        y -= 0.5f;
+        int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+        float fx = x - x0, fy = y - y0;
+        return (fetch(x0, y0) * (1 - fx) + fetch(x0 + 1, y0) * fx) * (1 - fy) +
+               (fetch(x0, y0 + 1) * (1 - fx) + fetch(x0 + 1, y0 + 1) * fx) * fy;
+    }
+
+    // square octahedral map with about as many texels as the source
+    void toOctahedral()
+    {
+        int size = std::max(2, (int)std::sqrt((double)width * height));
+        bool filter = bilinear;
+        bilinear = true;
+        std::vector<Texel> octa((size_t)size * size);
+        for (int j = 0; j < size; j++)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                float u = (i + 0.5f) / size * 2 - 1, v = (j + 0.5f) / size * 2 - 1;
+                Vec3f d(u, 1 - std::fabs(u) - std::fabs(v), v);
+                if (d.y < 0)
+                {
+                    d.x = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+                    d.z = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+                }
+                Vec3f c = lookup(normalize(d)) * 255.f;
+                Texel &t = octa[i + (size_t)j * size];
+                t.r = (uint8_t)std::min(255.f, c.x + 0.5f);
+                t.g = (uint8_t)std::min(255.f, c.y + 0.5f);
+                t.b = (uint8_t)std::min(255.f, c.z + 0.5f);
+            }
+        }
+        texels.swap(octa);
+        width = height = size;
+        layout = ENV_OCTAHEDRAL;
+        bilinear = filter;
+    }
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef Instance_h
+#define Instance_h
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "vectors.h"
+#include "functions.h"
+#include "objects.h"
+#include "bvh.h"
+#include "transform.h"
+
+// Primitives (and meshes) in their own object space with a BVH over
+// them, built once and shared by every Instance that places it. Only
+// bounded objects belong here; planes stay in the scene.
+class Geometry
+{
+public:
+    std::vector<std::unique_ptr<Object>> objects;
+    BVH bvh;
+    AABB bounds;
+
+    void build()
+    {
+        std::vector<AABB> boxes(objects.size());
+        bounds = AABB();
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            objects[i]->getBounds(boxes[i]);
+            bounds.expand(boxes[i]);
+        }
+        bvh.build(boxes);
+    }
+
+    // closest hit; hit.inner receives the object, the rest is its record
+    bool intersect(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        float tmax = std::numeric_limits<float>::max();
+        bool found = false;
+        HitRecord h;
+        bvh.traverse(orig, dir, tmax, [&](uint32_t i, float &limit) {
+            if (objects[i]->intersection(orig, dir, h) && h.t < limit)
+            {
+                limit = h.t;
+                hit.t = h.t;
+                hit.u = h.u;
+                hit.v = h.v;
+                hit.sub = h.sub;
+                hit.inner = i;
+                found = true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const
+    {
+        return bvh.traverse(orig, dir, tmax, [&](uint32_t i, float &limit) {
+            return objects[i]->occluded(orig, dir, limit);
+        });
+    }
+
+    // the objects with their own buffers, their list and the BVH
+    size_t memoryUsage() const
+    {
+        size_t bytes = objects.capacity() * sizeof(objects[0]) + bvh.nodes.capacity() * sizeof(BVHNode) + bvh.indices.capacity() * sizeof(uint32_t);
+        for (size_t i = 0; i < objects.size(); i++)
+            bytes += objects[i]->memoryUsage();
+        return bytes;
+    }
+};
+
+// One placement of a shared Geometry: a rigid frame, a uniform scale and
+// optionally a material that replaces the ones of the geometry. Rays are
+// taken into object space instead of copying the primitives, so an
+// instance costs the same whatever it refers to. The scene hierarchy only
+// sees the instance bounds: after moving instances, Scene::refit() or a
+// rebuild of that top level is all it takes, the geometry BVHs stay.
+class Instance : public Object
+{
+public:
+    std::shared_ptr<const Geometry> geometry;
+    Transform frame;
+    float scale;
+    bool overrideMaterial;
+    MaterialId material;
+
+    Instance(const std::shared_ptr<const Geometry> &g, const Transform &f, float s)
+        : geometry(g), frame(f), scale(s), overrideMaterial(false), material(0)
+    {
+        update();
+    }
+
+    Instance(const std::shared_ptr<const Geometry> &g, const Transform &f, float s, MaterialId m)
+        : geometry(g), frame(f), scale(s), overrideMaterial(true), material(m)
+    {
+        update();
+    }
+
+    // Origin and direction are scaled alike, so t stays that of the world ray.
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        return geometry->intersect(frame.localPoint(orig) * invScale, frame.localDirection(dir) * invScale, hit);
+    }
+
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const
+    {
+        return geometry->occluded(frame.localPoint(orig) * invScale, frame.localDirection(dir) * invScale, tmax);
+    }
+
+    void getData(const Vec3f &hit_point, const HitRecord &hit, Vec3f &N, MaterialId &mat) const
+    {
+        geometry->objects[hit.inner]->getData(frame.localPoint(hit_point) * invScale, hit, N, mat);
+        N = normalize(frame.direction(N));
+        if (overrideMaterial)
+            mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return true;
+    }
+
+    // the geometry is shared and counted once by its owner
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        frame.move(m);
+        update();
+    }
+
+    // places the instance anew; the scene refits afterwards
+    void place(const Transform &f, float s)
+    {
+        frame = f;
+        scale = s;
+        update();
+    }
+
+private:
+    float invScale;
+    AABB bounds;
+
+    void update()
+    {
+        invScale = 1 / scale;
+        bounds = AABB();
+        const AABB &b = geometry->bounds;
+        for (int c = 0; c < 8; c++)
+        {
+            Vec3f corner(c & 1 ? b.max.x : b.min.x, c & 2 ? b.max.y : b.min.y, c & 4 ? b.max.z : b.min.z);
+            bounds.expand(frame.point(corner * scale));
+        }
+    }
+};
+
+#endif
@@ -17,8 +17,9 @@ class Light
     Light() {}
     virtual ~Light() {}
     virtual void get_LightData(const Vec3f &, Vec3f &, Vec3f &, float &) const = 0;
-    
-    
+    // false: shading takes it without a shadow ray
+    virtual bool castsShadows() const { return true; }
+
 };
 
 class PointLight : public Light
@@ -56,6 +57,8 @@ class AmbientLight : public Light
         lightIntensity = color * intensity;
         distance = std::numeric_limits<float>::max(); 
     }
+    // no direction to be blocked along
+    bool castsShadows() const { return false; }
 
 
 };
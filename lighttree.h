@@ -0,0 +1,197 @@
+#ifndef LightTree_h
+#define LightTree_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vectors.h"
+#include "functions.h"
+#include "objects.h"
+#include "lights.h"
+
+enum LightMode
+{
+    LIGHTS_ALL,   // every light, one shadow ray each
+    LIGHTS_SAMPLE // a fixed number of lights per hit, picked by importance
+};
+
+struct LightNode
+{
+    AABB box;       // of the light positions below
+    float power;    // summed over the lights below
+    uint32_t first; // left child for inner nodes, the light for leaves
+    uint32_t count; // 0 for inner nodes, 1 for leaves
+};
+
+// Importance sampling of the shadowed lights of a scene. Point lights sit
+// in a binary hierarchy over their positions, one per leaf; other lights
+// with a direction of their own (DirectLight) are few and weighed one by
+// one next to the root. Lights that cast no shadows (AmbientLight) cost no
+// ray and are left to the caller.
+//
+// The shading has no distance falloff, so the estimate of a node is its
+// power times a bound on the cosine between the normal and any direction
+// into its box. The specular lobe does not vanish behind the surface,
+// though, so every light keeps a share (BACKSIDE) and none gets
+// probability zero.
+class LightTree
+{
+public:
+    static constexpr float BACKSIDE = 0.1f;
+
+    std::vector<LightNode> nodes;
+    std::vector<uint32_t> directional; // indices into the light list
+    std::vector<uint32_t> unshadowed;
+
+    void build(const std::vector<std::unique_ptr<Light>> &lights)
+    {
+        nodes.clear();
+        directional.clear();
+        unshadowed.clear();
+        std::vector<uint32_t> points;
+        for (uint32_t i = 0; i < lights.size(); i++)
+        {
+            if (!lights[i]->castsShadows())
+                unshadowed.push_back(i);
+            else if (dynamic_cast<const PointLight *>(lights[i].get()))
+                points.push_back(i);
+            else
+                directional.push_back(i);
+        }
+        if (points.empty())
+            return;
+
+        nodes.reserve(2 * points.size() - 1);
+        nodes.push_back(LightNode());
+        subdivide(0, points.data(), points.data() + points.size(), lights);
+    }
+
+    size_t pointCount() const { return (nodes.size() + 1) / 2; }
+
+    // Picks one shadowed light for a surface at p with normal N, using u
+    // in [0, 1); pdf is the probability it had. False if there is none.
+    bool sample(const Vec3f &p, const Vec3f &N, float u, const std::vector<std::unique_ptr<Light>> &lights, uint32_t &light, float &pdf) const
+    {
+        float tree = nodes.empty() ? 0 : importance(nodes[0], p, N);
+        float total = tree;
+        for (size_t k = 0; k < directional.size(); k++)
+            total += importance(*lights[directional[k]], p, N);
+        if (!(total > 0))
+            return false;
+
+        // the directional lights and the tree as a whole compete first
+        float x = u * total;
+        for (size_t k = 0; k < directional.size(); k++)
+        {
+            float w = importance(*lights[directional[k]], p, N);
+            if (x < w || (tree == 0 && k + 1 == directional.size()))
+            {
+                light = directional[k];
+                pdf = w / total;
+                return pdf > 0;
+            }
+            x -= w;
+        }
+        const float oneBelow = 0.99999994f;
+        pdf = tree / total;
+        u = std::min(x / tree, oneBelow);
+
+        uint32_t n = 0;
+        while (nodes[n].count == 0)
+        {
+            const LightNode &node = nodes[n];
+            float left = importance(nodes[node.first], p, N), right = importance(nodes[node.first + 1], p, N);
+            float pl = left + right > 0 ? left / (left + right) : 0.5f;
+            if (u < pl)
+            {
+                u = u / pl;
+                pdf *= pl;
+                n = node.first;
+            }
+            else
+            {
+                u = (u - pl) / (1 - pl);
+                pdf *= 1 - pl;
+                n = node.first + 1;
+            }
+            u = std::min(u, oneBelow);
+        }
+        light = nodes[n].first;
+        return pdf > 0;
+    }
+
+private:
+    static float power(const Vec3f &color, float intensity)
+    {
+        return std::max(0.f, intensity * (color.x + color.y + color.z) / 3);
+    }
+
+    static float importance(const LightNode &node, const Vec3f &p, const Vec3f &N)
+    {
+        Vec3f d = node.box.centroid() - p;
+        float dist = norma(d), radius = norma(node.box.max - node.box.min) * 0.5f;
+        float cosBound = 1;
+        if (dist > radius)
+        {
+            // N against the cone the box subtends from p
+            float cosN = dotProduct(N, d) / dist;
+            float sinCone = radius / dist, cosCone = std::sqrt(1 - sinCone * sinCone);
+            if (cosN < cosCone)
+                cosBound = cosN * cosCone + std::sqrt(std::max(0.f, 1 - cosN * cosN)) * sinCone;
+        }
+        return node.power * (std::max(0.f, cosBound) + BACKSIDE);
+    }
+
+    static float importance(const Light &light, const Vec3f &p, const Vec3f &N)
+    {
+        Vec3f dir, intensity;
+        float distance;
+        light.get_LightData(p, dir, intensity, distance);
+        float len = norma(dir);
+        float cosine = len > 0 ? dotProduct(N, dir) / len : 1;
+        return std::max(0.f, (intensity.x + intensity.y + intensity.z) / 3) * (std::max(0.f, cosine) + BACKSIDE);
+    }
+
+    // median split along the widest extent of the positions
+    void subdivide(uint32_t n, uint32_t *begin, uint32_t *end, const std::vector<std::unique_ptr<Light>> &lights)
+    {
+        AABB box;
+        float total = 0;
+        for (uint32_t *i = begin; i != end; i++)
+        {
+            const PointLight *light = static_cast<const PointLight *>(lights[*i].get());
+            box.expand(light->position);
+            total += power(light->color, light->intensity);
+        }
+        nodes[n].box = box;
+        nodes[n].power = total;
+        if (end - begin == 1)
+        {
+            nodes[n].first = *begin;
+            nodes[n].count = 1;
+            return;
+        }
+
+        Vec3f ext = box.max - box.min;
+        int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+        uint32_t *mid = begin + (end - begin) / 2;
+        std::nth_element(begin, mid, end, [&](uint32_t a, uint32_t b) {
+            const Vec3f &pa = static_cast<const PointLight *>(lights[a].get())->position;
+            const Vec3f &pb = static_cast<const PointLight *>(lights[b].get())->position;
+            return axis == 0 ? pa.x < pb.x : axis == 1 ? pa.y < pb.y : pa.z < pb.z;
+        });
+
+        uint32_t left = (uint32_t)nodes.size();
+        nodes[n].first = left;
+        nodes[n].count = 0;
+        nodes.push_back(LightNode());
+        nodes.push_back(LightNode());
+        subdivide(left, begin, mid, lights);
+        subdivide(left + 1, mid, end, lights);
+    }
+};
+
+#endif
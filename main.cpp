@@ -5,198 +5,31 @@
 #include <cmath>
 #include <limits>
 #include <ctime>
+#include <chrono>
+#include <random>
 
 #include <string>
 #include <memory>
 #include <vector>
 #include <unordered_map>
-
-#include "Bitmap.h"
-#include "vectors.h"
-#include "objects.h"
-#include "lights.h"
-#include "functions.h"
+#include <unordered_set>
+#include <mutex>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "lib/stb/stb_image_write.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "lib/stb/stb_image.h"
 
-const uint32_t RED = 0x000000FF;
-const uint32_t GREEN = 0x0000FF00;
-const uint32_t BLUE = 0x00FF0000;
-
-struct Settings
-{
-  int width;
-  int height;
-  float fov;
-  int maxDepth;
-  Vec3f backgroundColor;
-  float Kd;
-  float Ks;
-  float Kg;
-  float AA;
-  int envmap_ineed;
-  int envmap_width;
-  int envmap_height;
-};
-
-bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const std::vector<std::unique_ptr<Object>> &objects, Vec3f &hit, Vec3f &N, Material &material)
-{
-  float objects_dist = std::numeric_limits<float>::max();
-  for (size_t i = 0; i < objects.size(); i++)
-  {
-    float dist_i;
-    if (objects[i]->intersection(orig, dir, dist_i) && dist_i < objects_dist)
-    {
-      objects_dist = dist_i;
-      hit = orig + dir * dist_i;
-      objects[i]->getData(hit, N, material);
-    }
-  }
-  return objects_dist < 1000;
-}
-
-Vec3f newcast_ray(
-    const Vec3f &orig, const Vec3f &dir,
-    const std::vector<std::unique_ptr<Object>> &objects,
-    const std::vector<std::unique_ptr<Light>> &lights,
-    const std::vector<Vec3f> &envmap,
-    const Settings &settings,
-    size_t depth = 0)
-{
-
-  Vec3f hit_point, N;
-  Material material;
-  Vec3f PhongColor = 0;
-
-  if ((depth > settings.maxDepth) || (!(scene_intersect(orig, dir, objects, hit_point, N, material))))
-  {
-
-     if (settings.envmap_ineed == 0)
-    {
-      return settings.backgroundColor;
-    } 
-    Sphere env(Vec3f(0, 0, 0), 1000, Material());
-    float dist = 0;
-    env.intersection(orig, dir, dist);
-    Vec3f p = orig + dir * dist;
-    int a = (atan2(p.z, p.x) / (-2 * M_PI) + .5) * settings.envmap_width;
-    int b = acos(p.y / 1000) / M_PI * settings.envmap_height;
-    return envmap[a + b * settings.envmap_width];
-    //return settings.backgroundColor;
-  }
-
-  if (scene_intersect(orig, dir, objects, hit_point, N, material))
-  {
-
-    switch (material.materialType)
-    {
-
-     case GLOSSY:
-    {
-
-      float kr;
-      fresnel(dir, N, material.refract, kr);
-      Vec3f reflect_dir = normalize(reflect(dir, N));
-      Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4; // offset the original point to avoid occlusion by the object itself
-      Vec3f reflect_color = newcast_ray(reflect_orig, reflect_dir, objects, lights, envmap, settings, depth + 1);
-     
-
-      Vec3f diffuse = 0, specular = 0;
-      Vec3f shadow_orig = (dotProduct(dir, N) < 0) ? hit_point + N * 1e-4 : hit_point - N * 1e-4;
-      for (uint32_t i = 0; i < lights.size(); ++i)
-      {
-        Vec3f shadow_orig = (dotProduct(dir, N) < 0) ? hit_point + N * 1e-4 : hit_point - N * 1e-4;
-        Vec3f light_dir, light_intensity;
-        Vec3f shadow_pt, shadow_N;
-        float light_dist;
-        
-        Material tmp_mat;
-
-
-        lights[i]->get_LightData(hit_point, light_dir, light_intensity, light_dist);
-
-        if (scene_intersect(shadow_orig, light_dir, objects, shadow_pt, shadow_N, tmp_mat) && norma(shadow_pt-shadow_orig) < light_dist)
-            continue;
-        Vec3f reflectionDirection = reflect(-light_dir, N);
-        diffuse  += light_intensity * std::max(0.f, dotProduct(light_dir,N));
-        specular += light_intensity * powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), material.specular) ;
-      }
-      PhongColor = diffuse*material.diffuse_color*settings.Kd +
-                   material.diffuse_color*specular *0.6 +
-                    material.diffuse_color*reflect_color*settings.Kg;
-
-      //PhongColor = specular*0.2;
-      break;
-    }
-
-     case REFLECTION_AND_REFRACTION:
-    {
-      float kr;
-      fresnel(dir, N, material.refract, kr);
-      Vec3f reflect_dir = normalize(reflect(dir, N));
-      Vec3f refract_dir = normalize(refract(dir, N, material.refract));
-      Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4; // offset the original point to avoid occlusion by the object itself
-      Vec3f refract_orig = (dotProduct(refract_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4;
-      Vec3f reflect_color = newcast_ray(reflect_orig, reflect_dir, objects, lights, envmap, settings, depth + 1);
-      Vec3f refract_color = newcast_ray(refract_orig, refract_dir, objects, lights, envmap, settings, depth + 1);
-      PhongColor = reflect_color * kr + refract_color * (1 - kr);
-      break;
-    }
-    
-
-    case REFLECTION:
-    {
-      Vec3f reflect_dir = normalize(reflect(dir, N));
-      Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4; // offset the original point to avoid occlusion by the object itself
-      Vec3f reflect_color = newcast_ray(reflect_orig, reflect_dir, objects, lights, envmap, settings, depth + 1);
-      PhongColor += reflect_color * 0.8;
-      break;
-    } 
-
-    
-
-      default:
-    {
-
-      Vec3f diffuse = 0, specular = 0;
-      Vec3f shadowPointOrig = (dotProduct(dir, N) < 0) ? 
-                    hit_point + N * 1e-4 : 
-                    hit_point - N * 1e-4; 
-      for (uint32_t i = 0; i < lights.size(); ++i)
-      {
-        Vec3f shadow_orig = (dotProduct(dir, N) < 0) ? hit_point + N * 1e-4 : hit_point - N * 1e-4;
-        Vec3f light_dir, light_intensity;
-        Vec3f shadow_pt, shadow_N;
-        float light_dist;
-        
-        Material tmp_mat;
-
-
-        lights[i]->get_LightData(hit_point, light_dir, light_intensity, light_dist);
-
-        if (scene_intersect(shadow_orig, light_dir, objects, shadow_pt, shadow_N, tmp_mat) && norma(shadow_pt-shadow_orig) < light_dist)
-            continue;
-        Vec3f reflectionDirection = reflect(-light_dir, N);
-        diffuse  += light_intensity * std::max(0.f, dotProduct(light_dir,N));
-        specular += light_intensity * powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), material.specular) ;
-      }
-      PhongColor = diffuse*material.diffuse_color * settings.Kd + specular * settings.Ks ; //Kd = 0.8 Ks = 0.2
-      //PhongColor = specular*0.2; //Kd = 0.8 Ks = 0.2 albedo[0] + Vec3f(1., 1., 1.)*specular_light_intensity * material.albedo[1] + reflect_color*material.albedo[2];
-      break;
-      }
-    }
-  }
-
-  return PhongColor;
-}
+#include "renderer.h"
+#include "mesh.h"
+#include "meshloader.h"
+#include "tonemap.h"
+#include "server.h"
 
 int main(int argc, const char **argv)
 {
 
-  Settings settings;
+  Settings settings = default_settings();
 
   std::unordered_map<std::string, std::string> cmdLineParams;
 
@@ -220,192 +53,438 @@ int main(int argc, const char **argv)
   if (cmdLineParams.find("-out") != cmdLineParams.end())
     outFilePath = cmdLineParams["-out"];
 
-  int sceneId = 0;
+  std::string sceneFile;
   if (cmdLineParams.find("-scene") != cmdLineParams.end())
-    sceneId = atoi(cmdLineParams["-scene"].c_str());
+    sceneFile = cmdLineParams["-scene"];
 
   int threads = 1;
   if (cmdLineParams.find("-threads") != cmdLineParams.end())
     threads = atoi(cmdLineParams["-threads"].c_str());
 
-  //std::string envFilePath = "../envmap4.jpg";
-  settings.envmap_ineed = 0;
-
-  std::vector<Vec3f> envmap;
-
-  int n = -1;
-  unsigned char *pixmap = stbi_load("../envmap5.jpg", &settings.envmap_width, &settings.envmap_height, &n, 0);
-  if (!pixmap || 3 != n)
+  AccelType accel = ACCEL_BVH;
+  if (cmdLineParams.find("-accel") != cmdLineParams.end())
   {
-    std::cerr << "Error: can not load the environment map" << std::endl;
-    return -1;
+    std::string name = cmdLineParams["-accel"];
+    accel = (name == "linear") ? ACCEL_LINEAR : (name == "soa") ? ACCEL_SOA : (name == "packed") ? ACCEL_PACKED : ACCEL_BVH;
   }
-  envmap = std::vector<Vec3f>(settings.envmap_width * settings.envmap_height);
 
+  SimdLevel simd = SIMD_AVX2; // best the CPU has
+  if (cmdLineParams.find("-simd") != cmdLineParams.end())
+  {
+    std::string name = cmdLineParams["-simd"];
+    simd = (name == "reference") ? SIMD_REFERENCE : (name == "sse") ? SIMD_SSE : SIMD_AVX2;
+  }
 
-#pragma omp parallel for num_threads(threads)
-  for (int j = settings.envmap_height - 1; j >= 0; j--)
+  int tileSize = 16;
+  if (cmdLineParams.find("-tile") != cmdLineParams.end())
+    tileSize = std::max(1, std::min(256, atoi(cmdLineParams["-tile"].c_str())));
+
+  TileOrder tileOrder = ORDER_MORTON;
+  if (cmdLineParams.find("-tile_order") != cmdLineParams.end())
+    tileOrder = parseTileOrder(cmdLineParams["-tile_order"]);
+
+  ToneMapping toneMapping;
+  if (cmdLineParams.find("-tonemap") != cmdLineParams.end())
+    toneMapping.op = parseToneOperator(cmdLineParams["-tonemap"]);
+  if (cmdLineParams.find("-exposure") != cmdLineParams.end())
+    toneMapping.setExposure(atof(cmdLineParams["-exposure"].c_str()));
+  if (cmdLineParams.find("-gamma") != cmdLineParams.end())
+    toneMapping.setGamma(atof(cmdLineParams["-gamma"].c_str()));
+
+  bool bucket = false;
+  if (cmdLineParams.find("-bucket") != cmdLineParams.end())
+    bucket = atoi(cmdLineParams["-bucket"].c_str()) != 0;
+
+  if (cmdLineParams.find("-packet") != cmdLineParams.end())
+    settings.packet = std::max(0, std::min((int)BVH::MAX_PACKET, atoi(cmdLineParams["-packet"].c_str())));
+
+  if (cmdLineParams.find("-trace") != cmdLineParams.end())
+    settings.traceMode = cmdLineParams["-trace"] == "fresnel" ? TRACE_FRESNEL : TRACE_SPLIT;
+  if (cmdLineParams.find("-min_contrib") != cmdLineParams.end())
+    settings.minContrib = (float)atof(cmdLineParams["-min_contrib"].c_str());
+  if (cmdLineParams.find("-roulette") != cmdLineParams.end())
+    settings.rouletteDepth = std::max(0, atoi(cmdLineParams["-roulette"].c_str()));
+
+  if (cmdLineParams.find("-shadow_cache") != cmdLineParams.end())
+    settings.shadowCache = cmdLineParams["-shadow_cache"] != "0";
+
+  if (cmdLineParams.find("-lights") != cmdLineParams.end())
+    settings.lightMode = cmdLineParams["-lights"] == "sample" ? LIGHTS_SAMPLE : LIGHTS_ALL;
+  if (cmdLineParams.find("-light_samples") != cmdLineParams.end())
+    settings.lightSamples = std::max(1, atoi(cmdLineParams["-light_samples"].c_str()));
+
+  settings.wavefront = cmdLineParams.find("-wavefront") != cmdLineParams.end() && cmdLineParams["-wavefront"] != "0";
+
+  if (cmdLineParams.find("-aa") != cmdLineParams.end())
+    settings.aaAdaptive = cmdLineParams["-aa"] == "adaptive";
+  if (cmdLineParams.find("-aa_threshold") != cmdLineParams.end())
+    settings.aaThreshold = (float)atof(cmdLineParams["-aa_threshold"].c_str());
+  if (cmdLineParams.find("-aa_min") != cmdLineParams.end())
+    settings.aaMin = std::max(2, atoi(cmdLineParams["-aa_min"].c_str()));
+  if (cmdLineParams.find("-aa_max") != cmdLineParams.end())
+    settings.aaMax = atoi(cmdLineParams["-aa_max"].c_str());
+  settings.aaMax = std::max(settings.aaMin, settings.aaMax);
+
+  bool printStats = cmdLineParams.find("-stats") != cmdLineParams.end() && cmdLineParams["-stats"] != "0";
+  std::string heatmapPath;
+  if (cmdLineParams.find("-heatmap") != cmdLineParams.end())
+    heatmapPath = cmdLineParams["-heatmap"];
+#ifndef RT_STATS
+  if (printStats || !heatmapPath.empty())
+  {
+    std::cerr << "Warning: -stats and -heatmap need a build configured with -DRT_STATS=ON, ignored" << std::endl;
+    printStats = false;
+    heatmapPath.clear();
+  }
+#endif
+
+  int frames = 1;
+  if (cmdLineParams.find("-frames") != cmdLineParams.end())
+    frames = std::max(1, atoi(cmdLineParams["-frames"].c_str()));
+
+  // split render: this process traces only picture rows or tiles
+  // [first, last) and -out receives them as a partial float image that
+  // rt_merge assembles with the other pieces
+  std::string rangeFlag;
+  int rangeFirst = 0, rangeLast = 0;
+  if (cmdLineParams.find("-rows") != cmdLineParams.end())
+    rangeFlag = "-rows";
+  if (cmdLineParams.find("-tiles") != cmdLineParams.end())
   {
-    for (int i = 0; i < settings.envmap_width; i++)
+    if (!rangeFlag.empty())
     {
-      envmap[i + j * settings.envmap_width] = Vec3f(pixmap[(i + j * settings.envmap_width) * 3 + 0], pixmap[(i + j * settings.envmap_width) * 3 + 1], pixmap[(i + j * settings.envmap_width) * 3 + 2]) * (1 / 255.);
+      std::cerr << "Error: -rows and -tiles cannot be combined" << std::endl;
+      return -1;
     }
+    rangeFlag = "-tiles";
   }
-  stbi_image_free(pixmap);
-
-  /*    settings.width = 512;
-  settings.height = 512; */
-
-/*   settings.width = 1024;
-  settings.height = 796; */
-
-/*   settings.width = 1920;
-  settings.height = 1080;  */
-/*           settings.width = 3840;
-  settings.height = 2160; */
-
-  settings.fov = 90;
-  settings.maxDepth = 6;
-  settings.backgroundColor = Vec3f(0.0, 0.0, 0.0); // light blue Vec3f(0.2, 0.7, 0.8);
-  settings.Kd = 0.8;
-  settings.Ks = 0.2;
-  settings.Kg = 0.4;
-
-  Material orange(Vec3f(1, 0.4, 0.3), DIFFUSE, 1.0, 1.5);
-  Material red(Vec3f(0.40, 0.0, 0.0), GLOSSY, 3.0, 1.5);
-  Material green(Vec3f(0.0, 0.40, 0.0), GLOSSY, 5.0, 1.5);
-  Material blue(Vec3f(0.0, 0.00, 0.4), GLOSSY, 5.0, 1.5);
-  Material ivory(Vec3f(0.4, 0.4, 0.3), DIFFUSE, 5.0, 1.5);
-  Material checker(Vec3f(0.0, 0.0, 0.0), GLOSSY, 5.0, 1.5);
-  Material checker2(Vec3f(0.0, 0.0, 0.0), DIFFUSE, 5.0, 1.5);
-  Material gold(Vec3f(0.5, 0.4, 0.1), GLOSSY, 6.0, 1.5);
-  Material mirror(Vec3f(0.0, 10.0, 0.8), REFLECTION, 1.0, 1.5);
-  Material glass(Vec3f(0.0, 0.0, 0.0), REFLECTION_AND_REFRACTION, 1.0, 1.5); // change color LOOK CAREFULLY
-
-  std::vector<std::unique_ptr<Object>> objects;
-  std::vector<std::unique_ptr<Light>> lights; 
-
-
-  if (sceneId == 1)
+  if (!rangeFlag.empty())
   {
+    if (sscanf(cmdLineParams[rangeFlag].c_str(), "%d:%d", &rangeFirst, &rangeLast) != 2 || rangeFirst < 0 || rangeLast <= rangeFirst)
+    {
+      std::cerr << "Error: " << rangeFlag << " expects <first>:<last>, got '" << cmdLineParams[rangeFlag] << "'" << std::endl;
+      return -1;
+    }
+    if (bucket)
+    {
+      std::cerr << "Warning: -bucket does not apply to " << rangeFlag << ", ignored" << std::endl;
+      bucket = false;
+    }
+  }
 
-    Vec3f ta = Vec3f(-2, -4, -12);
-    Vec3f tb = Vec3f(-5, -4, -16);
-    Vec3f tc = Vec3f(1, -4, -16);
-    Vec3f top = Vec3f(-2, 2, -14);  
-    
-     settings.width = 1024;
-    settings.height = 796;
-    /* settings.width = 512;
-    settings.height = 512; */
-    settings.envmap_ineed = 0;
-    settings.AA = 1;
-
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(5, 0, -8), 0.5, glass)));
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(3, 0, -8), 0.5, gold)));
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(1, 0, -8), 0.5, green)));
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(-1, 0, -8), 0.5, ivory)));
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(-3, 0, -8), 0.5, orange)));
-    objects.push_back(std::unique_ptr<Object>(new Sphere(Vec3f(-5, 0, -8), 0.5, mirror)));
-
-
-
-    objects.push_back(std::unique_ptr<Object>(new Plane (Vec3f(0,0, -16),Vec3f(0,0,1 ),checker2)));
-
-
-    lights.push_back(std::unique_ptr<Light>( new DirectLight(Vec3f(-0.8, 0.8, 0.65), 0.55, Vec3f(1, 1, 1))));
-    lights.push_back(std::unique_ptr<Light>( new DirectLight(Vec3f(0, -0.8, 0.65), 0.55, Vec3f(1, 1, 1))));
-    lights.push_back(std::unique_ptr<Light>( new DirectLight(Vec3f(0.8, 0.8, 0.65), 0.55, Vec3f(1, 1, 1))));
+  long primCount = -1; // replaces the count of `generate` directives, -1 = as in the file
+  if (cmdLineParams.find("-count") != cmdLineParams.end())
+  {
+    primCount = atol(cmdLineParams["-count"].c_str());
+    if (primCount < 0)
+    {
+      std::cerr << "Error: -count needs 0 or more, got '" << cmdLineParams["-count"] << "'" << std::endl;
+      return -1;
+    }
   }
 
-  else if (sceneId == 2)
+  // daemon: scenes, envmaps and render threads stay warm between requests
+  if (cmdLineParams.find("-serve") != cmdLineParams.end())
   {
+    ServerConfig config;
+    config.settings = settings;
+    config.threads = threads;
+    if (cmdLineParams.find("-jobs") != cmdLineParams.end())
+      config.jobs = std::max(1, atoi(cmdLineParams["-jobs"].c_str()));
+    config.accel = accel;
+    config.simd = simd;
+    config.tileSize = tileSize;
+    config.tileOrder = tileOrder;
+    config.toneMapping = toneMapping;
+    if (cmdLineParams.find("-envmap_layout") != cmdLineParams.end())
+      config.envLayout = parseEnvLayout(cmdLineParams["-envmap_layout"]);
+    config.envBilinear = cmdLineParams.find("-envmap_filter") != cmdLineParams.end() && cmdLineParams["-envmap_filter"] == "bilinear";
+    RenderServer server(config);
+    std::string where = cmdLineParams["-serve"];
+    bool ok = (where == "stdin" || where.empty()) ? server.serveStdin() : server.serveSocket(where);
+    return ok ? 0 : 1;
+  }
 
-    Vec3f ta = Vec3f(-2, -4, -12);
-    Vec3f tb = Vec3f(-5, -4, -16);
-    Vec3f tc = Vec3f(1, -4, -16);
-    Vec3f top = Vec3f(-2, 2, -14);  
+  Scene scene;
+  std::vector<std::unique_ptr<Object>> &objects = scene.objects;
+  MaterialTable &materials = scene.materials;
 
+  if (sceneFile.empty())
+  {
+    std::cerr << "Error: no scene, use -scene <number> or -scene <file>" << std::endl;
+    return -1;
+  }
+  sceneFile = scene_path(sceneFile);
+  auto parseStart = std::chrono::steady_clock::now();
+  SceneOptions options;
+  SceneParser parser(scene, options, primCount);
+  if (!parser.load(sceneFile))
+    return -1;
+  std::cout << "scene: " << sceneFile << ", " << objects.size() << " objects, " << scene.lights.size() << " lights, parsed in "
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseStart).count() << " ms" << std::endl;
 
-    settings.width = 1024;
-    settings.height = 796;
-    settings.envmap_ineed = 0;
-    settings.AA = 4;
+  // instances share their geometry: memory follows the distinct ones
+  size_t instances = 0, geometryBytes = 0, geometryObjects = 0;
+  std::unordered_set<const Geometry *> geometries;
+  for (size_t i = 0; i < objects.size(); i++)
+  {
+    const Instance *instance = dynamic_cast<const Instance *>(objects[i].get());
+    if (!instance)
+      continue;
+    instances++;
+    if (geometries.insert(instance->geometry.get()).second)
+    {
+      geometryBytes += instance->geometry->memoryUsage();
+      geometryObjects += instance->geometry->objects.size();
+    }
+  }
+  if (instances)
+    std::cout << "instances: " << instances << " of " << geometries.size() << " geometries (" << geometryObjects << " objects, "
+              << geometryBytes / 1024.0 << " KB shared), " << sizeof(Instance) << " bytes/instance" << std::endl;
 
-    
-    objects.push_back(std::unique_ptr<Object>(new Plane (Vec3f(0,-4, 0),Vec3f(0,1,0 ),checker)));
+  apply_scene_options(options, settings);
 
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,top,tc, green)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,tb,top, blue)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(tc,tb,top, orange)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,tb,tc, orange)));
-    
-    lights.push_back(std::unique_ptr<Light>( new DirectLight(Vec3f(-0.5, 0.5, 1), 1.0, Vec3f(1,1,1))));
-    lights.push_back(std::unique_ptr<Light>( new PointLight(Vec3f(-20, 20, 20), 1.0, Vec3f(1,1,1))));
-    lights.push_back(std::unique_ptr<Light>( new PointLight(Vec3f(-30, 20, -25), 1.5, Vec3f(1,1,1))));
+  if (cmdLineParams.find("-mesh") != cmdLineParams.end()) // OBJ/PLY asset placed into the scene
+  {
+    auto loadStart = std::chrono::steady_clock::now();
+    std::unique_ptr<TriangleMesh> mesh(new TriangleMesh(materials.add(Material(Vec3f(0.4, 0.4, 0.3), DIFFUSE, 5.0, 1.5))));
+    if (!loadMesh(cmdLineParams["-mesh"], *mesh))
+      return -1;
+
+    Vec3f at(0, -1, -12);
+    float size = 6;
+    if (cmdLineParams.find("-mesh_at") != cmdLineParams.end())
+      sscanf(cmdLineParams["-mesh_at"].c_str(), "%f,%f,%f", &at.x, &at.y, &at.z);
+    if (cmdLineParams.find("-mesh_size") != cmdLineParams.end())
+      size = (float)atof(cmdLineParams["-mesh_size"].c_str());
+    mesh->fit(at, size);
+    mesh->build();
+
+    std::cout << "mesh: " << mesh->vertices.size() << " vertices, " << mesh->triangleCount() << " triangles, "
+              << (double)mesh->memoryUsage() / std::max<size_t>(1, mesh->triangleCount()) << " bytes/triangle, loaded in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count() << " ms" << std::endl;
+    objects.push_back(std::move(mesh));
   }
 
-  else if (sceneId == 3)
+  EnvironmentMap envmap;
+  if (settings.envmap_ineed) // only scenes that show the environment load it
   {
-     Vec3f ta = Vec3f(-2, -4, -12);
-    Vec3f tb = Vec3f(-5, -4, -16);
-    Vec3f tc = Vec3f(1, -4, -16);
-    Vec3f top = Vec3f(-2, 2, -14);  
-
-    settings.width = 1920;
-    settings.height = 1080;
-    settings.envmap_ineed = 1;
-    settings.AA = 1;
-    //objects.push_back(std::unique_ptr<Object>( new Sphere(Vec3f(0, 12, -40), 10, mirror)));
-    objects.push_back(std::unique_ptr<Object>( new Sphere(Vec3f(3, -2, -10), 1.5, ivory)));
-    objects.push_back(std::unique_ptr<Object>(new Cylinder (Vec3f(6,-4, -10), 1 ,3, green)));
-    objects.push_back(std::unique_ptr<Object>(new Cone (Vec3f(-6,-4, -10), 2 ,5, orange)));
-    objects.push_back(std::unique_ptr<Object>(new Plane (Vec3f(0,-4, 0),Vec3f(0,1,0 ),checker)));
-
-
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,top,tc, red)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,tb,top, blue)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(tc,tb,top, orange)));
-    objects.push_back(std::unique_ptr<Object>( new Triangle(ta,tb,tc, orange)));
-
-
-    lights.push_back(std::unique_ptr<Light>( new PointLight(Vec3f(0, 20, -6), 1.0, Vec3f(1, 1, 1))));
-    lights.push_back(std::unique_ptr<Light>( new PointLight(Vec3f(-30, 20, 20), 1.0, Vec3f(0.89, 0.73, 0.53))));
-    lights.push_back(std::unique_ptr<Light>( new PointLight(Vec3f(30, 20, 20), 1.0, Vec3f(0.89, 0.73, 0.53))));
+    std::string envFilePath = options.envmap;
+    if (cmdLineParams.find("-envmap") != cmdLineParams.end())
+      envFilePath = cmdLineParams["-envmap"];
+    EnvLayout layout = ENV_LATLONG;
+    if (cmdLineParams.find("-envmap_layout") != cmdLineParams.end())
+      layout = parseEnvLayout(cmdLineParams["-envmap_layout"]);
+    bool bilinear = cmdLineParams.find("-envmap_filter") != cmdLineParams.end() && cmdLineParams["-envmap_filter"] == "bilinear";
+    if (!load_envmap(envFilePath, layout, bilinear, envmap))
+      return -1;
+    std::cout << "envmap: " << envmap.getWidth() << "x" << envmap.getHeight() << (envmap.getLayout() == ENV_OCTAHEDRAL ? " octahedral" : " lat-long")
+              << (bilinear ? ", bilinear" : "") << ", " << envmap.memoryUsage() / 1024 << " KB" << std::endl;
   }
 
-  std::vector<uint32_t> image(settings.height * settings.width * 3);
-
-  float scale = tan(deg2rad(settings.fov * 0.5));
-  float imageAspectRatio = settings.width / (float)settings.height;
+  auto buildStart = std::chrono::steady_clock::now();
+  scene.accel = accel;
+  scene.simd = simd;
+  scene.build();
+  auto buildEnd = std::chrono::steady_clock::now();
+
+  // Whole frame, or with -bucket a few strips of one tile row each that
+  // are written out in order as soon as they are complete.
+  ImageFormat format = imageFormatFromPath(outFilePath);
+  std::vector<float> image;
+  StripWriter strips;
+  SimdLevel toneLevel = simd;
+  ToneKernel toneKernel = selectToneKernel(toneLevel);
+  Quantizer quantize = [&](const float *r, const float *g, const float *b, unsigned int *out, size_t n) {
+    toneKernel(r, g, b, out, n, toneMapping);
+  };
+  std::vector<Tile> partTiles;
+  int partY0 = 0, partY1 = settings.height;
+  size_t tracedPixels = (size_t)settings.width * settings.height;
+  if (!rangeFlag.empty())
+  {
+    if (rangeFlag == "-rows")
+      partTiles = rowRangeTiles(settings.width, settings.height, tileSize, rangeFirst, rangeLast);
+    else
+      partTiles = tileRangeTiles(settings.width, settings.height, tileSize, rangeFirst, rangeLast);
+    if (partTiles.empty())
+    {
+      std::cerr << "Error: " << rangeFlag << " " << cmdLineParams[rangeFlag] << " is outside the " << settings.width << "x" << settings.height << " frame" << std::endl;
+      return -1;
+    }
+    // only the rows the tiles span are held
+    partY0 = settings.height;
+    partY1 = 0;
+    tracedPixels = 0;
+    for (size_t i = 0; i < partTiles.size(); i++)
+    {
+      partY0 = std::min(partY0, partTiles[i].y0);
+      partY1 = std::max(partY1, partTiles[i].y1);
+      tracedPixels += (size_t)(partTiles[i].x1 - partTiles[i].x0) * (partTiles[i].y1 - partTiles[i].y0);
+    }
+  }
+  if (!bucket)
+    image.resize(3 * (size_t)(partY1 - partY0) * settings.width);
+
+  FrameContext frame = make_frame(scene, envmap, settings, options.camera, image.data());
+  frame.plane = (size_t)(partY1 - partY0) * settings.width;
+  frame.imageY0 = partY0;
+#ifdef RT_STATS
+  std::vector<float> cost;
+  if (!heatmapPath.empty())
+  {
+    cost.assign((size_t)settings.height * settings.width, 0);
+    frame.cost = cost.data();
+    if (cmdLineParams.find("-heatmap_metric") != cmdLineParams.end() && cmdLineParams["-heatmap_metric"] == "cycles")
+      frame.costMetric = COST_CYCLES;
+  }
+#endif
 
   std::cout << threads << std::endl;
-#pragma omp parallel for num_threads(threads)
-  for (size_t j = 0; j < settings.height; j++) // actual rendering loop
+  ThreadPool pool(threads);
+  TileScheduler scheduler;
+  std::vector<TilePixel> pixelOrder = tilePixelOrder(tileSize, tileOrder);
+
+  // The pool, the envmap, the materials and the scene stay resident from
+  // frame to frame; the animated objects move and the acceleration
+  // structure is refitted around them instead of being rebuilt.
+  double totalUpdate = 0, totalRefit = 0, totalTrace = 0, totalWrite = 0;
+  for (int f = 0; f < frames; f++)
   {
-    for (size_t i = 0; i < settings.width; i++)
+    std::string framePath = frame_path(outFilePath, f, frames);
+    double updateMs = 0, refitMs = 0;
+    if (f > 0)
     {
-      Vec3f temp = Vec3f(0, 0, 0);
-      for (size_t k = 0; k < settings.AA; k++)
-      {
-        float x = (2 * (i + 0.5 + k * 0.25) / (float)settings.width - 1) * imageAspectRatio * scale;
-        float y = (2 * (j + 0.5 - k * 0.25) / (float)settings.height - 1) * scale;
+      auto t0 = std::chrono::steady_clock::now();
+      scene.animate();
+      auto t1 = std::chrono::steady_clock::now();
+      scene.refit();
+      updateMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+      refitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+    }
 
-        Vec3f dir = normalize(Vec3f(x, y, -1));
-        temp += newcast_ray(Vec3f(0, 0, 1.5), dir, objects, lights, envmap, settings);
+    if (bucket)
+    {
+      if (!strips.open(framePath, format, settings.width, settings.height, tileSize, threads + 2, quantize))
+      {
+        std::cerr << "Error: cannot write " << framePath << std::endl;
+        return 1;
       }
-      temp = temp * (1.0 / settings.AA);
-      float max = std::max(temp.x, std::max(temp.y, temp.z));
-      if (max > 1)
-        temp = temp / max;
-      image[i + j * settings.width] = (uint32_t)(255 * std::max(0.f, std::min(1.f, temp.z))) << 16 | (uint32_t)(255 * std::max(0.f, std::min(1.f, temp.y))) << 8 | (uint32_t)(255 * std::max(0.f, std::min(1.f, temp.x)));
+      scheduler.resetOrdered(settings.width, settings.height, tileSize, strips.topDown());
     }
+    else if (!partTiles.empty())
+      scheduler.reset(partTiles, pool.size());
+    else
+      scheduler.reset(settings.width, settings.height, tileSize, pool.size());
+
+    FrameStats stats = render_frame(frame, pool, scheduler, pixelOrder, bucket ? &strips : nullptr);
+    std::vector<WorkerStats> &workerStats = stats.workers;
+    HitCounters &counters = stats.counters;
+    double wall = stats.wall;
+    uint64_t rays = counters.intersectCalls + counters.occludedCalls;
+
+    if (frames == 1)
+    {
+      const char *accelNames[] = {"linear", "soa", "bvh", "packed"};
+      std::cout << "accel: " << accelNames[accel];
+      if (accel == ACCEL_PACKED)
+        std::cout << " (" << simdName(scene.packed.level) << ")";
+      std::cout << ", " << objects.size() << " objects" << std::endl;
+      std::cout << "build: " << std::chrono::duration<double, std::milli>(buildEnd - buildStart).count() << " ms" << std::endl;
+      if (settings.lightMode == LIGHTS_SAMPLE)
+      {
+        const LightTree &tree = scene.lightTree;
+        std::cout << "lights: " << scene.lights.size() << " (" << tree.pointCount() << " point in a tree of " << tree.nodes.size() << " nodes, "
+                  << tree.directional.size() << " directional, " << tree.unshadowed.size() << " unshadowed), " << settings.lightSamples
+                  << " shadow rays per hit" << std::endl;
+      }
+      std::cout << "render: " << wall << " ms" << std::endl;
+      double busyTotal = 0;
+      for (size_t w = 0; w < workerStats.size(); w++)
+      {
+        busyTotal += workerStats[w].busy;
+        std::cout << "  thread " << w << ": busy " << workerStats[w].busy << " ms, idle " << std::max(0.0, wall - workerStats[w].busy)
+                  << " ms, " << workerStats[w].tiles << " tiles (" << workerStats[w].stolen << " stolen)" << std::endl;
+      }
+      std::cout << "  utilization: " << 100 * busyTotal / (wall * workerStats.size()) << "%" << std::endl;
+      double seconds = wall / 1000;
+      std::cout << "rays: " << rays << " (" << counters.intersectCalls << " closest-hit, " << counters.occludedCalls << " shadow), "
+                << rays / seconds / 1e6 << " Mrays/s" << (settings.packet > 0 ? " [packets of " + std::to_string(settings.packet) + "]" : "") << std::endl;
+      std::cout << "samples: " << counters.samples << " (" << (double)counters.samples / tracedPixels << " per pixel"
+                << (settings.aaAdaptive ? ", adaptive" : "") << "), culled secondary rays: " << counters.culledRays << std::endl;
+      std::cout << "scene_intersect: " << counters.intersectCalls << " calls ("
+                << counters.legacyIntersectCalls - counters.intersectCalls << " saved), getData: "
+                << counters.getDataCalls << " calls (" << counters.legacyGetDataCalls - counters.getDataCalls << " saved)" << std::endl;
+    }
+#ifdef RT_STATS
+    if (printStats)
+      print_ray_stats(stats.rays, counters);
+    if (!heatmapPath.empty())
+    {
+      std::string path = frame_path(heatmapPath, f, frames);
+      float top;
+      if (!write_heatmap(path, cost.data(), settings.width, settings.height, top))
+      {
+        std::cerr << "Error: cannot write " << path << std::endl;
+        return 1;
+      }
+      std::cout << "heatmap: " << path << ", red at " << top << (frame.costMetric == COST_CYCLES ? " cycles" : " rays") << " per pixel" << std::endl;
+    }
+#endif
+
+    // tone mapping and quantization run as a pass of their own: over the
+    // finished frame here, per strip on the writer thread with -bucket
+    auto writeStart = std::chrono::steady_clock::now();
+    bool saved;
+    double toneMs = 0;
+    if (bucket)
+    {
+      saved = strips.close();
+      toneMs = strips.quantizeMs();
+      if (frames == 1)
+        std::cout << "framebuffer: " << strips.memoryUsage() / 1024 << " KB (" << strips.stripCount() << " strips of " << tileSize << " rows, streamed)" << std::endl;
+    }
+    else if (!partTiles.empty())
+    {
+      saved = save_partial(framePath, frame, partTiles, frame_hash(frame, sceneFile, f));
+      if (frames == 1)
+        std::cout << "partial: rows " << settings.height - partY1 << ".." << settings.height - partY0 << " of " << settings.height << ", " << partTiles.size()
+                  << " tiles, " << image.capacity() * sizeof(float) / 1024 << " KB, merge with rt_merge" << std::endl;
+    }
+    else
+    {
+      saved = save_frame(framePath, image.data(), settings.width, settings.height, pool, quantize, toneMs);
+      size_t packedBytes = format == IMAGE_PFM ? 0 : frame.plane * sizeof(uint32_t);
+      if (frames == 1)
+        std::cout << "framebuffer: " << (image.capacity() * sizeof(float) + packedBytes) / 1024 << " KB" << std::endl;
+    }
+    if (frames == 1 && format != IMAGE_PFM && partTiles.empty())
+      std::cout << "tonemap: " << toneMs << " ms (" << simdName(toneLevel) << ")" << std::endl;
+    if (!saved)
+    {
+      std::cerr << "Error: cannot write " << framePath << std::endl;
+      return 1;
+    }
+    // with -bucket most of the writing overlaps the trace; this is the wait for the rest
+    double writeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - writeStart).count();
+
+    if (frames > 1)
+      std::cout << "frame " << f << ": update " << updateMs << " ms, refit " << refitMs << " ms, trace " << wall << " ms ("
+                << rays / (wall / 1000) / 1e6 << " Mrays/s), write " << writeMs << " ms -> " << framePath << std::endl;
+    totalUpdate += updateMs;
+    totalRefit += refitMs;
+    totalTrace += wall;
+    totalWrite += writeMs;
   }
 
-  //stbi_write_bmp(outFilePath.c_str(), settings.width, settings.height, 3, image.data());
-  SaveBMP(outFilePath.c_str(), image.data(), settings.width, settings.height);
+  if (frames > 1)
+  {
+    std::cout << "animation: " << frames << " frames, " << scene.motions.size() << " moving groups, build " << std::chrono::duration<double, std::milli>(buildEnd - buildStart).count()
+              << " ms once; per frame: update " << totalUpdate / (frames - 1) << " ms, refit " << totalRefit / (frames - 1) << " ms, trace "
+              << totalTrace / frames << " ms, write " << totalWrite / frames << " ms" << std::endl;
+  }
 
   //std::cout << "end." << std::endl;
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,85 @@
+#ifndef Materials_h
+#define Materials_h
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+
+enum MaterialPattern
+{
+    PATTERN_NONE,
+    PATTERN_STRIPES_X, // alternates along x
+    PATTERN_CHECKER_XZ // checkerboard in the xz plane
+};
+
+// Scene-wide materials. Primitives keep a MaterialId and shading reads the
+// entry by reference. A procedural entry has no material of its own: it
+// picks one of two other entries from the hit position.
+class MaterialTable
+{
+public:
+    static const size_t MAX_MATERIALS = 65536;
+
+    MaterialId add(const Material &m)
+    {
+        Entry e;
+        e.material = m;
+        e.pattern = PATTERN_NONE;
+        return push(e);
+    }
+
+    // `odd` where the pattern cell index is odd, `even` elsewhere; cells
+    // are 1 / scale wide
+    MaterialId addPattern(MaterialPattern pattern, double scale, MaterialId odd, MaterialId even)
+    {
+        Entry e;
+        e.pattern = pattern;
+        e.scale = scale;
+        e.odd = odd;
+        e.even = even;
+        return push(e);
+    }
+
+    const Material &get(MaterialId id, const Vec3f &p) const
+    {
+        const Entry *e = &entries[id];
+        while (e->pattern != PATTERN_NONE)
+        {
+            bool odd;
+            if (e->pattern == PATTERN_STRIPES_X)
+                odd = int(e->scale * p.x + 1000) & 1;
+            else
+                odd = (int(e->scale * p.x + 1000) + int(e->scale * p.z)) & 1;
+            e = &entries[odd ? e->odd : e->even];
+        }
+        return e->material;
+    }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry
+    {
+        Material material;
+        MaterialPattern pattern;
+        double scale;
+        MaterialId odd, even;
+    };
+    std::vector<Entry> entries;
+
+    MaterialId push(const Entry &e)
+    {
+        if (entries.size() >= MAX_MATERIALS)
+        {
+            std::cerr << "Error: more than " << MAX_MATERIALS << " materials, reusing the last one" << std::endl;
+            return (MaterialId)(MAX_MATERIALS - 1);
+        }
+        entries.push_back(e);
+        return (MaterialId)(entries.size() - 1);
+    }
+};
+
+#endif
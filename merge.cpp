@@ -0,0 +1,140 @@
+// rt_merge: assembles the partial images of a split render (rt -rows or
+// rt -tiles) into the final frame. Sampling depends only on the pixel, so
+// the pieces join without seams and the result equals a single-process
+// render byte for byte.
+//
+//   rt_merge -out final.png [-tonemap max] [-exposure 0] [-gamma 1]
+//            [-simd avx2] part0.rtp part1.rtp ...
+
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+
+#include "ImageWriter.h"
+#include "tonemap.h"
+
+int main(int argc, const char **argv)
+{
+  std::unordered_map<std::string, std::string> cmdLineParams;
+  std::vector<std::string> parts;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string key(argv[i]);
+
+    if (key.size() > 0 && key[0] == '-')
+    {
+      if (i != argc - 1)
+      {
+        cmdLineParams[key] = argv[i + 1];
+        i++;
+      }
+      else
+        cmdLineParams[key] = "";
+    }
+    else
+      parts.push_back(key);
+  }
+
+  if (parts.empty() || cmdLineParams.find("-out") == cmdLineParams.end())
+  {
+    std::cerr << "usage: rt_merge -out <image> [-tonemap max|clamp|reinhard|aces] [-exposure <stops>] [-gamma <g>] [-simd reference|sse|avx2] <part>..." << std::endl;
+    return 1;
+  }
+  std::string outFilePath = cmdLineParams["-out"];
+
+  // the same output options as rt, given to the merge instead
+  ToneMapping toneMapping;
+  if (cmdLineParams.find("-tonemap") != cmdLineParams.end())
+    toneMapping.op = parseToneOperator(cmdLineParams["-tonemap"]);
+  if (cmdLineParams.find("-exposure") != cmdLineParams.end())
+    toneMapping.setExposure(atof(cmdLineParams["-exposure"].c_str()));
+  if (cmdLineParams.find("-gamma") != cmdLineParams.end())
+    toneMapping.setGamma(atof(cmdLineParams["-gamma"].c_str()));
+
+  SimdLevel simd = SIMD_AVX2; // best the CPU has
+  if (cmdLineParams.find("-simd") != cmdLineParams.end())
+  {
+    std::string name = cmdLineParams["-simd"];
+    simd = (name == "reference") ? SIMD_REFERENCE : (name == "sse") ? SIMD_SSE : SIMD_AVX2;
+  }
+
+  auto readStart = std::chrono::steady_clock::now();
+  int width = 0, height = 0;
+  std::vector<float> red, green, blue;
+  std::vector<unsigned char> coverage;
+  uint64_t firstHash = 0;
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    std::string error;
+    uint64_t frameHash;
+    if (!readPartialImage(parts[i], width, height, frameHash, red, green, blue, coverage, error))
+    {
+      std::cerr << "Error: " << error << std::endl;
+      return 1;
+    }
+    // parts of another scene, camera or quality setting would splice silently
+    if (i == 0)
+      firstHash = frameHash;
+    else if (frameHash != firstHash)
+    {
+      std::cerr << "Error: " << parts[i] << " is from a different render than " << parts[0] << " (scene or settings differ)" << std::endl;
+      return 1;
+    }
+  }
+  double readMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - readStart).count();
+
+  // every pixel has to come from exactly one piece; rows are reported
+  // from the top as they are given to -rows
+  size_t missing = 0, overlapping = 0;
+  int missingX = 0, missingRow = 0;
+  for (int row = 0; row < height; row++)
+  {
+    const unsigned char *c = &coverage[(size_t)(height - 1 - row) * width];
+    for (int x = 0; x < width; x++)
+    {
+      if (c[x] == 0 && missing++ == 0)
+      {
+        missingX = x;
+        missingRow = row;
+      }
+      if (c[x] > 1)
+        overlapping++;
+    }
+  }
+  if (overlapping)
+    std::cerr << "Warning: " << overlapping << " pixels are in more than one part" << std::endl;
+  if (missing)
+  {
+    std::cerr << "Error: " << missing << " pixels are in no part, the first at column " << missingX << ", row " << missingRow << std::endl;
+    return 1;
+  }
+
+  auto writeStart = std::chrono::steady_clock::now();
+  size_t plane = (size_t)width * height;
+  ImageWriter writer;
+  bool saved = writer.open(outFilePath, imageFormatFromPath(outFilePath), width, height);
+  std::vector<uint32_t> packed;
+  if (saved && !writer.isFloat())
+  {
+    packed.resize(plane);
+    selectToneKernel(simd)(red.data(), green.data(), blue.data(), packed.data(), plane, toneMapping);
+  }
+  for (int y = 0; saved && y < height; y++)
+  {
+    size_t row = (size_t)(writer.topDown() ? height - 1 - y : y) * width;
+    if (writer.isFloat())
+      writer.writeRow(&red[row], &green[row], &blue[row]);
+    else
+      writer.writeRow(&packed[row]);
+  }
+  if (!saved || !writer.close())
+  {
+    std::cerr << "Error: cannot write " << outFilePath << std::endl;
+    return 1;
+  }
+
+  std::cout << "merge: " << parts.size() << " parts, " << width << "x" << height << ", read " << readMs << " ms, write "
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - writeStart).count() << " ms -> " << outFilePath << std::endl;
+  return 0;
+}
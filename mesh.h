@@ -0,0 +1,189 @@
+#ifndef Mesh_h
+#define Mesh_h
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+#include "bvh.h"
+
+// Indexed triangle mesh. Vertices (and optional per-vertex normals) are
+// shared; a triangle costs three indices plus the two edges the
+// intersection test needs, all in flat arrays behind one object. Front
+// faces are counter-clockwise as in OBJ and PLY files.
+class TriangleMesh : public Object
+{
+public:
+    std::vector<Vec3f> vertices;
+    std::vector<Vec3f> normals;    // empty, or one per vertex
+    std::vector<uint32_t> indices; // three per triangle
+    MaterialId material;
+
+    TriangleMesh(MaterialId m) : material(m) {}
+
+    size_t triangleCount() const { return indices.size() / 3; }
+
+    // Uniform scale and translation so the longest side of the bounds
+    // becomes `size` and their center lands on `center`.
+    void fit(const Vec3f &center, float size)
+    {
+        AABB box;
+        for (size_t i = 0; i < vertices.size(); i++)
+            box.expand(vertices[i]);
+        Vec3f ext = box.max - box.min;
+        float longest = std::max(ext.x, std::max(ext.y, ext.z));
+        float s = longest > 0 ? size / longest : 1;
+        Vec3f mid = box.centroid();
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i] = center + (vertices[i] - mid) * s;
+    }
+
+    // Once the buffers are filled: edges, bounds and the inner BVH.
+    // Triangles are renumbered in leaf order so a leaf reads contiguous data.
+    void build()
+    {
+        size_t n = triangleCount();
+        std::vector<AABB> boxes(n);
+        bounds = AABB();
+        for (size_t t = 0; t < n; t++)
+        {
+            for (int k = 0; k < 3; k++)
+                boxes[t].expand(vertices[indices[3 * t + k]]);
+            bounds.expand(boxes[t]);
+        }
+        bvh.build(boxes);
+        boxes.clear();
+        boxes.shrink_to_fit();
+
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t k = 0; k < n; k++)
+        {
+            uint32_t t = bvh.indices[k];
+            sorted[3 * k] = indices[3 * t];
+            sorted[3 * k + 1] = indices[3 * t + 1];
+            sorted[3 * k + 2] = indices[3 * t + 2];
+            bvh.indices[k] = (uint32_t)k;
+        }
+        indices.swap(sorted);
+
+        edges.resize(2 * n);
+        updateEdges();
+    }
+
+    // bytes held by the mesh, its buffers and its BVH
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + vertices.capacity() * sizeof(Vec3f) + normals.capacity() * sizeof(Vec3f) + indices.capacity() * sizeof(uint32_t) +
+               edges.capacity() * sizeof(Vec3f) + bvh.nodes.capacity() * sizeof(BVHNode) + bvh.indices.capacity() * sizeof(uint32_t);
+    }
+
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        float tmax = std::numeric_limits<float>::max();
+        bool found = false;
+        bvh.traverse(orig, dir, tmax, [&](uint32_t t, float &limit) {
+            float tt, u, v;
+            if (intersectTriangle(t, orig, dir, tt, u, v) && tt < limit)
+            {
+                limit = tt;
+                hit.t = tt;
+                hit.u = u;
+                hit.v = v;
+                hit.sub = t;
+                found = true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const
+    {
+        return bvh.traverse(orig, dir, tmax, [&](uint32_t t, float &limit) {
+            float tt, u, v;
+            return intersectTriangle(t, orig, dir, tt, u, v) && tt < limit;
+        });
+    }
+
+    void getData(
+        const Vec3f &hit_point,
+        const HitRecord &hit,
+        Vec3f &N,
+        MaterialId &mat) const
+    {
+        const uint32_t *tri = &indices[3 * hit.sub];
+        N = 0;
+        if (!normals.empty())
+            N = normals[tri[0]] * (1 - hit.u - hit.v) + normals[tri[1]] * hit.u + normals[tri[2]] * hit.v;
+        if (dotProduct(N, N) < 1e-12f)
+            N = crossProduct(edges[2 * hit.sub], edges[2 * hit.sub + 1]);
+        N = normalize(N);
+        mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return !indices.empty();
+    }
+
+    // Moves vertices and normals; the edges follow and the inner BVH is
+    // refitted, its topology stays.
+    void move(const RigidMotion &m)
+    {
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i] = m.point(vertices[i]);
+        for (size_t i = 0; i < normals.size(); i++)
+            normals[i] = m.direction(normals[i]);
+        updateEdges();
+        bvh.refit([&](uint32_t t) {
+            AABB box;
+            for (int k = 0; k < 3; k++)
+                box.expand(vertices[indices[3 * t + k]]);
+            return box;
+        });
+        bounds = bvh.empty() ? AABB() : bvh.nodes[0].box;
+    }
+
+private:
+    void updateEdges()
+    {
+        for (size_t t = 0; t < triangleCount(); t++)
+        {
+            const Vec3f &v0 = vertices[indices[3 * t]];
+            edges[2 * t] = vertices[indices[3 * t + 1]] - v0;
+            edges[2 * t + 1] = vertices[indices[3 * t + 2]] - v0;
+        }
+    }
+
+    std::vector<Vec3f> edges; // v1 - v0 and v2 - v0 per triangle
+    AABB bounds;
+    BVH bvh;
+
+    // Moller-Trumbore on the stored edges; u/v weight v1/v2 as for Triangle
+    bool intersectTriangle(uint32_t t, const Vec3f &orig, const Vec3f &dir, float &tnear, float &u, float &v) const
+    {
+        RT_STAT(rayStats.tests[PRIM_MESH_TRIANGLE]++);
+        const Vec3f &e1 = edges[2 * t], &e2 = edges[2 * t + 1];
+        Vec3f pvec = crossProduct(dir, e2);
+        float det = dotProduct(e1, pvec);
+        if (std::fabs(det) < 1e-12f)
+            return false;
+        float invDet = 1 / det;
+        Vec3f tvec = orig - vertices[indices[3 * t]];
+        u = dotProduct(tvec, pvec) * invDet;
+        if (u < 0 || u > 1)
+            return false;
+        Vec3f qvec = crossProduct(tvec, e1);
+        v = dotProduct(dir, qvec) * invDet;
+        if (v < 0 || u + v > 1)
+            return false;
+        tnear = dotProduct(e2, qvec) * invDet;
+        return tnear > 1e-9f;
+    }
+};
+
+#endif
@@ -0,0 +1,417 @@
+#ifndef MeshLoader_h
+#define MeshLoader_h
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+
+// Streaming readers that append straight into the mesh buffers: no
+// per-triangle objects or whole-file copies are made. Polygons are split
+// into triangle fans. The caller runs mesh.build() afterwards.
+
+// Reads one line of any length into `line`; false at end of file.
+bool readLine(FILE *f, std::string &line)
+{
+    line.clear();
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), f))
+    {
+        line += buf;
+        if (!line.empty() && line[line.size() - 1] == '\n')
+            return true;
+    }
+    return !line.empty();
+}
+
+// OBJ index (1-based, negative = relative to the end) to a 0-based one
+bool objIndex(long i, size_t count, uint32_t &out)
+{
+    long k = i > 0 ? i - 1 : (long)count + i;
+    if (i == 0 || k < 0 || k >= (long)count)
+        return false;
+    out = (uint32_t)k;
+    return true;
+}
+
+// Wavefront OBJ: v, vn and f records. A vertex takes the normal its face
+// corners name (the last one if they disagree); texture coordinates and
+// everything else are skipped.
+bool loadOBJ(const std::string &path, TriangleMesh &mesh)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<Vec3f> fileNormals;
+    std::vector<uint32_t> face, faceNormals;
+    std::string line;
+    size_t lineNo = 0;
+    bool ok = true;
+    while (ok && readLine(f, line))
+    {
+        lineNo++;
+        const char *p = line.c_str();
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char *end;
+            float x = strtof(p + 2, &end);
+            float y = strtof(end, &end);
+            float z = strtof(end, &end);
+            mesh.vertices.push_back(Vec3f(x, y, z));
+        }
+        else if (p[0] == 'v' && p[1] == 'n')
+        {
+            char *end;
+            float x = strtof(p + 2, &end);
+            float y = strtof(end, &end);
+            float z = strtof(end, &end);
+            fileNormals.push_back(Vec3f(x, y, z));
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            face.clear();
+            faceNormals.clear();
+            const char *q = p + 2;
+            for (;;)
+            {
+                while (*q == ' ' || *q == '\t')
+                    q++;
+                if (*q == '\0' || *q == '\n' || *q == '\r' || *q == '#')
+                    break;
+                char *end;
+                uint32_t v, n = UINT32_MAX;
+                if (!objIndex(strtol(q, &end, 10), mesh.vertices.size(), v))
+                {
+                    ok = false;
+                    break;
+                }
+                q = end;
+                if (*q == '/')
+                {
+                    q++;
+                    if (*q != '/')
+                    {
+                        strtol(q, &end, 10); // texture coordinate
+                        q = end;
+                    }
+                    if (*q == '/')
+                    {
+                        long ni = strtol(q + 1, &end, 10);
+                        q = end;
+                        if (!objIndex(ni, fileNormals.size(), n))
+                            n = UINT32_MAX;
+                    }
+                }
+                while (*q && *q != ' ' && *q != '\t' && *q != '\n' && *q != '\r')
+                    q++;
+                face.push_back(v);
+                faceNormals.push_back(n);
+            }
+            for (size_t k = 0; k < face.size(); k++)
+            {
+                if (faceNormals[k] == UINT32_MAX)
+                    continue;
+                if (mesh.normals.size() < mesh.vertices.size())
+                    mesh.normals.resize(mesh.vertices.size(), Vec3f(0));
+                mesh.normals[face[k]] = fileNormals[faceNormals[k]];
+            }
+            for (size_t k = 2; k < face.size(); k++)
+            {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[k - 1]);
+                mesh.indices.push_back(face[k]);
+            }
+        }
+    }
+    fclose(f);
+
+    if (!ok)
+    {
+        std::cerr << "Error: bad face index in " << path << ":" << lineNo << std::endl;
+        return false;
+    }
+    if (!mesh.normals.empty())
+        mesh.normals.resize(mesh.vertices.size(), Vec3f(0));
+    return true;
+}
+
+enum PlyType
+{
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+    PLY_INVALID
+};
+
+PlyType plyType(const std::string &name)
+{
+    if (name == "char" || name == "int8")
+        return PLY_INT8;
+    if (name == "uchar" || name == "uint8")
+        return PLY_UINT8;
+    if (name == "short" || name == "int16")
+        return PLY_INT16;
+    if (name == "ushort" || name == "uint16")
+        return PLY_UINT16;
+    if (name == "int" || name == "int32")
+        return PLY_INT32;
+    if (name == "uint" || name == "uint32")
+        return PLY_UINT32;
+    if (name == "float" || name == "float32")
+        return PLY_FLOAT32;
+    if (name == "double" || name == "float64")
+        return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+size_t plySize(PlyType type)
+{
+    static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
+    return sizes[type];
+}
+
+struct PlyProperty
+{
+    std::string name;
+    PlyType type;
+    PlyType countType; // PLY_INVALID unless this is a list
+};
+
+struct PlyElement
+{
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+// Pulls single values out of an ASCII or binary PLY body.
+class PlyReader
+{
+public:
+    PlyReader(FILE *file, bool ascii, bool swap) : f(file), ascii(ascii), swap(swap), good(true) {}
+
+    bool ok() const { return good; }
+
+    double read(PlyType type)
+    {
+        if (ascii)
+        {
+            double value;
+            if (fscanf(f, "%lf", &value) != 1)
+            {
+                good = false;
+                return 0;
+            }
+            return value;
+        }
+
+        unsigned char raw[8];
+        size_t size = plySize(type);
+        if (fread(raw, 1, size, f) != size)
+        {
+            good = false;
+            return 0;
+        }
+        if (swap)
+            for (size_t k = 0; k < size / 2; k++)
+                std::swap(raw[k], raw[size - 1 - k]);
+        switch (type)
+        {
+        case PLY_INT8: { int8_t v; memcpy(&v, raw, 1); return v; }
+        case PLY_UINT8: { uint8_t v; memcpy(&v, raw, 1); return v; }
+        case PLY_INT16: { int16_t v; memcpy(&v, raw, 2); return v; }
+        case PLY_UINT16: { uint16_t v; memcpy(&v, raw, 2); return v; }
+        case PLY_INT32: { int32_t v; memcpy(&v, raw, 4); return v; }
+        case PLY_UINT32: { uint32_t v; memcpy(&v, raw, 4); return v; }
+        case PLY_FLOAT32: { float v; memcpy(&v, raw, 4); return v; }
+        case PLY_FLOAT64: { double v; memcpy(&v, raw, 8); return v; }
+        default: good = false; return 0;
+        }
+    }
+
+private:
+    FILE *f;
+    bool ascii;
+    bool swap;
+    bool good;
+};
+
+// Stanford PLY, ASCII or binary of either byte order: vertex x/y/z with
+// optional nx/ny/nz, and face vertex_indices lists. Other elements and
+// properties are read past.
+bool loadPLY(const std::string &path, TriangleMesh &mesh)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    bool ascii = false, bigEndian = false, header = true;
+    std::vector<PlyElement> elements;
+    if (!readLine(f, line) || line.compare(0, 3, "ply") != 0)
+        header = false;
+    while (header && readLine(f, line))
+    {
+        char a[64] = {0}, b[64] = {0}, c[64] = {0}, d[64] = {0}, e[64] = {0};
+        int n = sscanf(line.c_str(), "%63s %63s %63s %63s %63s", a, b, c, d, e);
+        std::string key(a);
+        if (key == "end_header")
+            break;
+        if (key == "format" && n >= 2)
+        {
+            ascii = std::string(b) == "ascii";
+            bigEndian = std::string(b) == "binary_big_endian";
+        }
+        else if (key == "element" && n >= 3)
+        {
+            PlyElement e;
+            e.name = b;
+            e.count = (size_t)strtoull(c, nullptr, 10);
+            elements.push_back(e);
+        }
+        else if (key == "property" && n >= 3 && !elements.empty())
+        {
+            PlyProperty prop;
+            if (std::string(b) == "list" && n >= 5)
+            {
+                prop.countType = plyType(c);
+                prop.type = plyType(d);
+                prop.name = e;
+            }
+            else
+            {
+                prop.countType = PLY_INVALID;
+                prop.type = plyType(b);
+                prop.name = c;
+            }
+            if (prop.type == PLY_INVALID)
+                header = false;
+            elements.back().properties.push_back(prop);
+        }
+    }
+    if (!header)
+    {
+        std::cerr << "Error: " << path << " is not a PLY file this reader understands" << std::endl;
+        fclose(f);
+        return false;
+    }
+
+    uint16_t probe = 1;
+    bool hostBig = *reinterpret_cast<unsigned char *>(&probe) == 0;
+    PlyReader reader(f, ascii, !ascii && bigEndian != hostBig);
+
+    std::vector<uint32_t> poly;
+    for (size_t e = 0; e < elements.size() && reader.ok(); e++)
+    {
+        const PlyElement &el = elements[e];
+        bool isVertex = el.name == "vertex", isFace = el.name == "face";
+        int slot[6] = {-1, -1, -1, -1, -1, -1}; // x y z nx ny nz
+        const char *names[6] = {"x", "y", "z", "nx", "ny", "nz"};
+        for (size_t k = 0; k < el.properties.size(); k++)
+            for (int s = 0; s < 6; s++)
+                if (el.properties[k].name == names[s])
+                    slot[s] = (int)k;
+        bool withNormals = isVertex && slot[3] >= 0 && slot[4] >= 0 && slot[5] >= 0;
+        size_t base = mesh.vertices.size();
+        if (isVertex)
+        {
+            mesh.vertices.reserve(base + el.count);
+            if (withNormals)
+                mesh.normals.reserve(base + el.count);
+        }
+        if (isFace)
+            mesh.indices.reserve(mesh.indices.size() + 3 * el.count);
+
+        double values[6];
+        for (size_t i = 0; i < el.count && reader.ok(); i++)
+        {
+            for (size_t k = 0; k < el.properties.size(); k++)
+            {
+                const PlyProperty &prop = el.properties[k];
+                if (prop.countType == PLY_INVALID)
+                {
+                    double v = reader.read(prop.type);
+                    for (int s = 0; s < 6; s++)
+                        if (slot[s] == (int)k)
+                            values[s] = v;
+                    continue;
+                }
+                size_t count = (size_t)reader.read(prop.countType);
+                bool indices = isFace && (prop.name == "vertex_indices" || prop.name == "vertex_index");
+                poly.clear();
+                for (size_t j = 0; j < count; j++)
+                {
+                    double v = reader.read(prop.type);
+                    if (indices)
+                        poly.push_back((uint32_t)v);
+                }
+                for (size_t j = 2; indices && j < poly.size(); j++)
+                {
+                    mesh.indices.push_back(poly[0]);
+                    mesh.indices.push_back(poly[j - 1]);
+                    mesh.indices.push_back(poly[j]);
+                }
+            }
+            if (isVertex)
+            {
+                mesh.vertices.push_back(Vec3f((float)values[0], (float)values[1], (float)values[2]));
+                if (withNormals)
+                    mesh.normals.push_back(Vec3f((float)values[3], (float)values[4], (float)values[5]));
+            }
+        }
+    }
+    fclose(f);
+
+    if (!reader.ok())
+    {
+        std::cerr << "Error: " << path << " ends early" << std::endl;
+        return false;
+    }
+    for (size_t k = 0; k < mesh.indices.size(); k++)
+    {
+        if (mesh.indices[k] >= mesh.vertices.size())
+        {
+            std::cerr << "Error: bad face index in " << path << std::endl;
+            return false;
+        }
+    }
+    if (mesh.normals.size() != mesh.vertices.size())
+        mesh.normals.clear();
+    return true;
+}
+
+// Picks the reader by file extension.
+bool loadMesh(const std::string &path, TriangleMesh &mesh)
+{
+    size_t dot = path.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (size_t k = 0; k < ext.size(); k++)
+        ext[k] = (char)tolower(ext[k]);
+    if (ext == "ply")
+        return loadPLY(path, mesh);
+    if (ext == "obj")
+        return loadOBJ(path, mesh);
+    std::cerr << "Error: unknown mesh format " << path << std::endl;
+    return false;
+}
+
+#endif
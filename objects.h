@@ -6,9 +6,12 @@
 #include <vector>
 #include <iostream>
 #include <random>
+#include <algorithm>
+#include <cstdint>
 
 #include "vectors.h"
 #include "functions.h"
+#include "stats.h"
 
 
 
@@ -31,13 +34,112 @@ struct Material
     float refract;
 };
 
+// index into the scene's MaterialTable
+typedef uint16_t MaterialId;
+
+struct AABB
+{
+    Vec3f min;
+    Vec3f max;
+
+    AABB() : min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+    AABB(const Vec3f &a, const Vec3f &b) : min(a), max(b) {}
+
+    void expand(const Vec3f &p)
+    {
+        min = Vec3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vec3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    void expand(const AABB &b)
+    {
+        expand(b.min);
+        expand(b.max);
+    }
+
+    Vec3f centroid() const { return (min + max) * 0.5f; }
+
+    float surfaceArea() const
+    {
+        Vec3f d = max - min;
+        if (d.x < 0 || d.y < 0 || d.z < 0)
+            return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // slab test, invDir = 1 / dir; tnear is the entry distance (clamped to 0)
+    bool intersect(const Vec3f &orig, const Vec3f &invDir, const float &tmax, float &tnear) const
+    {
+        float t0 = 0, t1 = tmax;
+        for (int a = 0; a < 3; a++)
+        {
+            float tA = (min[a] - orig[a]) * invDir[a];
+            float tB = (max[a] - orig[a]) * invDir[a];
+            if (tA > tB)
+                std::swap(tA, tB);
+            t0 = tA > t0 ? tA : t0;
+            t1 = tB < t1 ? tB : t1;
+            if (t0 > t1)
+                return false;
+        }
+        tnear = t0;
+        return true;
+    }
+};
+
+// Compact result of an intersection test. Normal and material are only
+// evaluated afterwards, for the winning hit, through Object::getData.
+struct HitRecord
+{
+    float t;
+    uint32_t index; // object index in the scene
+    float u, v;     // barycentrics for triangles, unused otherwise
+    uint32_t sub;   // triangle within a mesh, QuadricPart of a quadric, unused otherwise
+    uint32_t inner; // object within the geometry of an Instance
+};
+
+// One animation step of a rigid body: a turn by `degrees` about the
+// vertical axis through `pivot`, then a shift by `offset`. Cones and
+// cylinders stand along Y, so they stay upright under it; the oriented
+// quadrics turn their frame with it.
+struct RigidMotion
+{
+    Vec3f offset;
+    Vec3f pivot;
+    float cosA, sinA;
+
+    RigidMotion() : offset(0), pivot(0), cosA(1), sinA(0) {}
+    RigidMotion(const Vec3f &o, const Vec3f &p, float degrees) : offset(o), pivot(p)
+    {
+        cosA = std::cos(deg2rad(degrees));
+        sinA = std::sin(deg2rad(degrees));
+    }
+
+    Vec3f direction(const Vec3f &d) const { return Vec3f(cosA * d.x + sinA * d.z, d.y, cosA * d.z - sinA * d.x); }
+    Vec3f point(const Vec3f &p) const { return pivot + direction(p - pivot) + offset; }
+};
+
 class Object
 {
 public:
     Object() {}
     virtual ~Object() {}
-    virtual bool intersection(const Vec3f &, const Vec3f &, float &) const = 0;
-    virtual void getData(const Vec3f &, Vec3f &, Material &) const = 0;
+    // fills hit.t (and hit.u/v where the primitive has them), never hit.index
+    virtual bool intersection(const Vec3f &, const Vec3f &, HitRecord &) const = 0;
+    // normal at the hit and the material to look up in the MaterialTable
+    virtual void getData(const Vec3f &, const HitRecord &, Vec3f &, MaterialId &) const = 0;
+    // false for unbounded primitives (planes), which stay out of the BVH
+    virtual bool getBounds(AABB &) const = 0;
+    // bytes the object holds, itself included
+    virtual size_t memoryUsage() const = 0;
+    // animation; the scene refits its acceleration structure afterwards
+    virtual void move(const RigidMotion &m) = 0;
+    // any hit closer than tmax; primitives with an inner hierarchy stop at the first one
+    virtual bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const
+    {
+        HitRecord h;
+        return intersection(orig, dir, h) && h.t < tmax;
+    }
 };
 
 class Sphere : public Object
@@ -45,12 +147,18 @@ class Sphere : public Object
 public:
     Vec3f center;
     float radius;
-    Material material;
+    MaterialId material;
+
+    Sphere(const Vec3f &c, const float &r, MaterialId m) : center(c), radius(r), material(m){};
 
-    Sphere(const Vec3f &c, const float &r, const Material &m) : center(c), radius(r), material(m){};
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        return intersect(center, radius, orig, dir, hit.t);
+    }
 
-    bool intersection(const Vec3f &orig, const Vec3f &dir, float &tnear) const
+    static bool intersect(const Vec3f &center, const float &radius, const Vec3f &orig, const Vec3f &dir, float &tnear)
     {
+        RT_STAT(rayStats.tests[PRIM_SPHERE]++);
         // analytic solution
         Vec3f L = orig - center;
         float a = dotProduct(dir, dir);
@@ -70,12 +178,23 @@ public:
 
     void getData(
         const Vec3f &hit_point,
+        const HitRecord &hit,
         Vec3f &N,
-        Material &mat) const
+        MaterialId &mat) const
     {
         N = normalize(hit_point - center);
         mat = material;
     }
+
+    bool getBounds(AABB &box) const
+    {
+        box = AABB(center - Vec3f(radius), center + Vec3f(radius));
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m) { center = m.point(center); }
 };
 
 
@@ -85,12 +204,19 @@ class Triangle : public Object
     Vec3f v0;
     Vec3f v1;
     Vec3f v2;
-    Material material;
+    MaterialId material;
+
+    Triangle (const Vec3f &a,const Vec3f &b,const Vec3f &c, MaterialId m) : v0(a),v1(b),v2(c),material(m){}
 
-    Triangle (const Vec3f &a,const Vec3f &b,const Vec3f &c, const Material &m) : v0(a),v1(b),v2(c),material(m){}
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        return intersect(v0, v1, v2, orig, dir, hit.t, hit.u, hit.v);
+    }
 
-    bool intersection(const Vec3f &orig, const Vec3f &dir, float &tnear) const
+    // Cramer's rule on the barycentric system; u/v receive beta/gamma
+    static bool intersect(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Vec3f &orig, const Vec3f &dir, float &tnear, float &u, float &v)
     {
+        RT_STAT(rayStats.tests[PRIM_TRIANGLE]++);
         float a = v0.x - v1.x , b = v0.x - v2.x , c = dir.x , d = v0.x - orig.x;
         float e = v0.y - v1.y , f = v0.y - v2.y , g = dir.y , h = v0.y - orig.y;
         float i = v0.z - v1.z , j = v0.z - v2.z , k = dir.z , l = v0.z - orig.z;
@@ -119,7 +245,9 @@ class Triangle : public Object
         if (t < 1e-9)
             return false;
 
-        tnear =t;
+        tnear = t;
+        u = beta;
+        v = gamma;
 
         return true; 
 
@@ -128,14 +256,33 @@ class Triangle : public Object
 
     void getData(
         const Vec3f &hit_point,
+        const HitRecord &hit,
         Vec3f &N,
-        Material &mat) const
+        MaterialId &mat) const
     {
         N = crossProduct((v1 - v0),(v2 - v0));
         N = -normalize(N);
         //N = Vec3f(0,1,0);
         mat = material;
     }
+
+    bool getBounds(AABB &box) const
+    {
+        box = AABB();
+        box.expand(v0);
+        box.expand(v1);
+        box.expand(v2);
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        v0 = m.point(v0);
+        v1 = m.point(v1);
+        v2 = m.point(v2);
+    }
 };
 
 
@@ -145,13 +292,19 @@ public:
     Vec3f center;
     float radius;
     float height;
-    Material material;
+    MaterialId material;
 
-    Cone(const Vec3f &c, const float &r, const float &h, const Material &m) : center(c), radius(r), height(h), material(m){};
+    Cone(const Vec3f &c, const float &r, const float &h, MaterialId m) : center(c), radius(r), height(h), material(m){};
 
 
-    bool intersection(const Vec3f &orig, const Vec3f &dir, float &tnear) const
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
     {
+        return intersect(center, radius, height, orig, dir, hit.t);
+    }
+
+    static bool intersect(const Vec3f &center, const float &radius, const float &height, const Vec3f &orig, const Vec3f &dir, float &tnear)
+    {
+        RT_STAT(rayStats.tests[PRIM_CONE]++);
         float tangent = radius/height;
         
         float a = (dir.x * dir.x) + (dir.z * dir.z) - ((tangent * tangent)* (dir.y*dir.y));
@@ -178,14 +331,25 @@ public:
 
     void getData(
         const Vec3f &hit_point,
+        const HitRecord &hit,
         Vec3f &N,
-        Material &mat) const
+        MaterialId &mat) const
     {
        float r = sqrt((hit_point.x-center.x)*(hit_point.x-center.x) + (hit_point.z-center.z)*(hit_point.z-center.z));
         N = normalize(Vec3f (hit_point.x-center.x, r*(radius/height), hit_point.z-center.z));
         mat = material;
     }
 
+    bool getBounds(AABB &box) const
+    {
+        box = AABB(Vec3f(center.x - radius, center.y, center.z - radius), Vec3f(center.x + radius, center.y + height, center.z + radius));
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m) { center = m.point(center); }
+
 
 };
 
@@ -196,12 +360,18 @@ public:
    // Vec3f dir_cyl; TODO will be pretty hard
     float radius;
     float height;
-    Material material;
+    MaterialId material;
+
+    Cylinder(const Vec3f &c, const float &r, const float &h, MaterialId m) : center(c), radius(r), height(h), material(m){};
 
-    Cylinder(const Vec3f &c, const float &r, const float &h, const Material &m) : center(c), radius(r), height(h), material(m){};
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        return intersect(center, radius, height, orig, dir, hit.t);
+    }
 
-    bool intersection(const Vec3f &orig, const Vec3f &dir, float &tnear) const
+    static bool intersect(const Vec3f &center, const float &radius, const float &height, const Vec3f &orig, const Vec3f &dir, float &tnear)
     {
+        RT_STAT(rayStats.tests[PRIM_CYLINDER]++);
         float a = (dir.x * dir.x) + (dir.z * dir.z);
         float b = 2 * (dir.x * (orig.x - center.x) + dir.z * (orig.z - center.z));
         float c = (orig.x - center.x) * (orig.x - center.x) + (orig.z - center.z) * (orig.z - center.z) - (radius * radius);
@@ -210,46 +380,16 @@ public:
         Vec3f p_top = Vec3f(center.x, center.y + height, center.z);
 
         if (!solveQuadratic(a, b, c, t0, t1))
-        {
-            if (intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear))
-            {
-                return intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear);
-            }
-            else
-            {
-                return (intersectCylinderCapsBottom(Vec3f(0, 1, 0), center, orig, dir, tnear));
-            }
-        }
-        //return false;
+            return intersectCaps(center, p_top, orig, dir, radius, tnear);
 
         if (t0 < 0)
             t0 = t1;
         if (t0 < 0)
-        {
-            if (intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear))
-            {
-                return intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear);
-            }
-            else
-            {
-                return (intersectCylinderCapsBottom(Vec3f(0, 1, 0), center, orig, dir, tnear));
-            }
-        }
-        //return false;
+            return intersectCaps(center, p_top, orig, dir, radius, tnear);
 
         float r = orig.y + t0 * dir.y;
         if (!((r >= center.y) and (r <= center.y + height)))
-        {
-            if (intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear))
-            {
-                return intersectCylinderCapsTop(Vec3f(0, 1, 0), p_top, orig, dir, tnear);
-            }
-            else
-            {
-                return (intersectCylinderCapsBottom(Vec3f(0, 1, 0), center, orig, dir, tnear));
-            }
-        }
-        //return false;
+            return intersectCaps(center, p_top, orig, dir, radius, tnear);
 
         tnear = t0;
 
@@ -258,8 +398,9 @@ public:
 
     void getData(
         const Vec3f &hit_point,
+        const HitRecord &hit,
         Vec3f &N,
-        Material &mat) const
+        MaterialId &mat) const
     {
         Vec3f top = Vec3f(center.x, center.y + height, center.z);
         Vec3f axis = normalize(top - center);
@@ -282,10 +423,29 @@ public:
         mat = material;
     }
 
-    bool intersectCylinderCapsTop(const Vec3f &n, const Vec3f &p0, const Vec3f &l0, const Vec3f &l, float &t) const
+    bool getBounds(AABB &box) const
+    {
+        box = AABB(Vec3f(center.x - radius, center.y, center.z - radius), Vec3f(center.x + radius, center.y + height, center.z + radius));
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m) { center = m.point(center); }
+
+    // the top cap if the ray meets it, else the bottom one
+    static bool intersectCaps(const Vec3f &bottom, const Vec3f &top, const Vec3f &orig, const Vec3f &dir, const float &radius, float &tnear)
+    {
+        if (intersectCylinderCapsTop(Vec3f(0, 1, 0), top, orig, dir, radius, tnear))
+            return true;
+        return intersectCylinderCapsBottom(Vec3f(0, 1, 0), bottom, orig, dir, radius, tnear);
+    }
+
+    // p0 is the cap center
+    static bool intersectCylinderCapsTop(const Vec3f &n, const Vec3f &p0, const Vec3f &l0, const Vec3f &l, const float &radius, float &t)
     {
         float reserver = t;
-        Vec3f p1 = Vec3f(center.x, center.y + height, center.z);
+        Vec3f p1 = p0;
         if (!(intersectPlane((Vec3f(0, -1, 0)), p0, l0, l, t)))
         {
             return false;
@@ -299,10 +459,10 @@ public:
         }
         return false;
     }
-    bool intersectCylinderCapsBottom(const Vec3f &n, const Vec3f &p0, const Vec3f &l0, const Vec3f &l, float &t) const
+    static bool intersectCylinderCapsBottom(const Vec3f &n, const Vec3f &p0, const Vec3f &l0, const Vec3f &l, const float &radius, float &t)
     {
         float reserver = t;
-        Vec3f p1 = Vec3f(center.x, center.y, center.z);
+        Vec3f p1 = p0;
         if (!(intersectPlane((Vec3f(0, 1, 0)), p0, l0, l, t)))
         {
             return false;
@@ -325,12 +485,18 @@ class Plane : public Object
     public:
     Vec3f v0;
     Vec3f n;
-    Material material;
+    MaterialId material;
+
+    Plane (const Vec3f &a, const Vec3f &nn ,MaterialId m) : v0(a),n(nn),material(m){}
 
-    Plane (const Vec3f &a, const Vec3f &nn ,const Material &m) : v0(a),n(nn),material(m){}
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        return intersect(v0, n, orig, dir, hit.t);
+    }
 
-    bool intersection(const Vec3f &orig, const Vec3f &dir, float &tnear) const
+    static bool intersect(const Vec3f &v0, const Vec3f &n, const Vec3f &orig, const Vec3f &dir, float &tnear)
     {
+        RT_STAT(rayStats.tests[PRIM_PLANE]++);
         float t = dotProduct((v0 - orig) , n) / dotProduct(dir, n); 
 														
         if (t < 1e-9)
@@ -346,25 +512,25 @@ class Plane : public Object
 
     void getData(
         const Vec3f &hit_point,
+        const HitRecord &hit,
         Vec3f &N,
-        Material &mat) const
+        MaterialId &mat) const
     {
         N = normalize(n);
+        mat = material;
+    }
 
-        if ( dotProduct(N,Vec3f(0,0,-1))) // plane at XY
-        {
-            mat = material;
-            mat.diffuse_color = (int(.85 * hit_point.x + 1000)) & 1 ? Vec3f(1, 1, 1) : Vec3f(0, 0, 0);
-            mat.diffuse_color = mat.diffuse_color*0.7;
-        }
-        else
-        {
-            mat = material;
-            mat.diffuse_color = (int(.25 * hit_point.x + 1000) + int(.25 * hit_point.z)) & 1 ? Vec3f(1, 1, 1) : Vec3f(0, 0, 0);
-            mat.diffuse_color = mat.diffuse_color*0.5;
-        }
-        
-        
+    bool getBounds(AABB &) const
+    {
+        return false;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        v0 = m.point(v0);
+        n = m.direction(n);
     }
 };
 
@@ -0,0 +1,292 @@
+#ifndef Packed_h
+#define Packed_h
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+#include "bvh.h"
+#include "simd.h"
+
+// Spheres and triangles in SIMD_WIDTH-wide blocks, each behind its own BVH
+// whose leaves are exactly one block. Other primitive types are few in
+// practice and keep the virtual call.
+template <typename Block>
+struct PackedSet
+{
+    BVH bvh;
+    std::vector<Block> blocks;
+    std::vector<uint32_t> object; // SIMD_WIDTH entries per block, UINT32_MAX for padding
+};
+
+class PackedScene
+{
+public:
+    PackedSet<SphereBlock> spheres;
+    PackedSet<TriangleBlock> triangles;
+    std::vector<uint32_t> rest;
+    SimdLevel level; // what actually runs after clamping to the CPU
+    SimdKernels kernels;
+
+    void build(const std::vector<std::unique_ptr<Object>> &objects, SimdLevel requested)
+    {
+        level = requested;
+        kernels = selectKernels(level);
+
+        std::vector<const Sphere *> sp;
+        std::vector<const Triangle *> tr;
+        std::vector<uint32_t> spIdx, trIdx;
+        rest.clear();
+        for (uint32_t i = 0; i < objects.size(); i++)
+        {
+            if (const Sphere *s = dynamic_cast<const Sphere *>(objects[i].get()))
+            {
+                sp.push_back(s);
+                spIdx.push_back(i);
+            }
+            else if (const Triangle *t = dynamic_cast<const Triangle *>(objects[i].get()))
+            {
+                tr.push_back(t);
+                trIdx.push_back(i);
+            }
+            else
+                rest.push_back(i);
+        }
+
+        pack(spheres, sp, spIdx, fillSphere);
+        pack(triangles, tr, trIdx, fillTriangle);
+    }
+
+    // After objects moved: lanes are reloaded and the block BVHs refitted,
+    // blocks keep their members.
+    void refit(const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        repack(spheres, objects, fillSphere);
+        repack(triangles, objects, fillTriangle);
+    }
+
+    void intersect(const Vec3f &orig, const Vec3f &dir, const std::vector<std::unique_ptr<Object>> &objects, HitRecord &hit, uint64_t &closer) const
+    {
+        float tmax = hit.t;
+        spheres.bvh.traverse(orig, dir, tmax, [&](uint32_t b, float &t) {
+            RT_STAT(rayStats.tests[PRIM_SPHERE] += SIMD_WIDTH);
+            int lane = kernels.spheres(spheres.blocks[b], orig, dir, t);
+            if (lane >= 0)
+            {
+                hit.t = t;
+                hit.index = spheres.object[b * SIMD_WIDTH + lane];
+                closer++;
+            }
+            return false;
+        });
+        float u, v;
+        triangles.bvh.traverse(orig, dir, tmax, [&](uint32_t b, float &t) {
+            RT_STAT(rayStats.tests[PRIM_TRIANGLE] += SIMD_WIDTH);
+            int lane = kernels.triangles(triangles.blocks[b], orig, dir, t, u, v);
+            if (lane >= 0)
+            {
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.index = triangles.object[b * SIMD_WIDTH + lane];
+                closer++;
+            }
+            return false;
+        });
+
+        HitRecord h;
+        for (size_t k = 0; k < rest.size(); k++)
+        {
+            if (objects[rest[k]]->intersection(orig, dir, h) && h.t < hit.t)
+            {
+                hit = h;
+                hit.index = rest[k];
+                closer++;
+            }
+        }
+    }
+
+    // Same as intersect() for n rays sharing an origin, with one traversal
+    // per type for the whole packet; closer[r] counts improvements per ray.
+    void intersectPacket(const Vec3f &orig, const Vec3f *dir, int n, const std::vector<std::unique_ptr<Object>> &objects, HitRecord *hit, uint64_t *closer) const
+    {
+        float tmax[BVH::MAX_PACKET];
+        for (int r = 0; r < n; r++)
+            tmax[r] = hit[r].t;
+
+        spheres.bvh.traversePacket(orig, dir, n, tmax, [&](uint32_t b, uint32_t mask, float *t) {
+            for (int r = 0; r < n; r++)
+            {
+                if (!(mask >> r & 1))
+                    continue;
+                RT_STAT(rayStats.tests[PRIM_SPHERE] += SIMD_WIDTH);
+                int lane = kernels.spheres(spheres.blocks[b], orig, dir[r], t[r]);
+                if (lane >= 0)
+                {
+                    hit[r].t = t[r];
+                    hit[r].index = spheres.object[b * SIMD_WIDTH + lane];
+                    closer[r]++;
+                }
+            }
+        });
+        triangles.bvh.traversePacket(orig, dir, n, tmax, [&](uint32_t b, uint32_t mask, float *t) {
+            float u, v;
+            for (int r = 0; r < n; r++)
+            {
+                if (!(mask >> r & 1))
+                    continue;
+                RT_STAT(rayStats.tests[PRIM_TRIANGLE] += SIMD_WIDTH);
+                int lane = kernels.triangles(triangles.blocks[b], orig, dir[r], t[r], u, v);
+                if (lane >= 0)
+                {
+                    hit[r].t = t[r];
+                    hit[r].u = u;
+                    hit[r].v = v;
+                    hit[r].index = triangles.object[b * SIMD_WIDTH + lane];
+                    closer[r]++;
+                }
+            }
+        });
+
+        HitRecord h;
+        for (size_t k = 0; k < rest.size(); k++)
+        {
+            for (int r = 0; r < n; r++)
+            {
+                if (objects[rest[k]]->intersection(orig, dir[r], h) && h.t < hit[r].t)
+                {
+                    hit[r] = h;
+                    hit[r].index = rest[k];
+                    closer[r]++;
+                }
+            }
+        }
+    }
+
+    // `occluder` receives the object found in the way
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax, const std::vector<std::unique_ptr<Object>> &objects, uint32_t &occluder) const
+    {
+        for (size_t k = 0; k < rest.size(); k++)
+        {
+            if (objects[rest[k]]->occluded(orig, dir, tmax))
+            {
+                occluder = rest[k];
+                return true;
+            }
+        }
+
+        float limit = tmax, u, v;
+        if (spheres.bvh.traverse(orig, dir, limit, [&](uint32_t b, float &t) {
+                float tb = t;
+                RT_STAT(rayStats.tests[PRIM_SPHERE] += SIMD_WIDTH);
+                int lane = kernels.spheres(spheres.blocks[b], orig, dir, tb);
+                if (lane < 0)
+                    return false;
+                occluder = spheres.object[b * SIMD_WIDTH + lane];
+                return true;
+            }))
+            return true;
+        limit = tmax;
+        return triangles.bvh.traverse(orig, dir, limit, [&](uint32_t b, float &t) {
+            float tb = t;
+            RT_STAT(rayStats.tests[PRIM_TRIANGLE] += SIMD_WIDTH);
+            int lane = kernels.triangles(triangles.blocks[b], orig, dir, tb, u, v);
+            if (lane < 0)
+                return false;
+            occluder = triangles.object[b * SIMD_WIDTH + lane];
+            return true;
+        });
+    }
+
+private:
+    static void fillSphere(SphereBlock &b, int k, const Sphere *s)
+    {
+        b.cx[k] = s->center.x;
+        b.cy[k] = s->center.y;
+        b.cz[k] = s->center.z;
+        b.r2[k] = s->radius * s->radius;
+    }
+
+    static void fillTriangle(TriangleBlock &b, int k, const Triangle *t)
+    {
+        Vec3f e1 = t->v1 - t->v0, e2 = t->v2 - t->v0;
+        b.v0x[k] = t->v0.x;
+        b.v0y[k] = t->v0.y;
+        b.v0z[k] = t->v0.z;
+        b.e1x[k] = e1.x;
+        b.e1y[k] = e1.y;
+        b.e1z[k] = e1.z;
+        b.e2x[k] = e2.x;
+        b.e2y[k] = e2.y;
+        b.e2z[k] = e2.z;
+    }
+
+    template <typename Block, typename Prim>
+    static void repack(PackedSet<Block> &set, const std::vector<std::unique_ptr<Object>> &objects, void (*fill)(Block &, int, const Prim *))
+    {
+        for (size_t b = 0; b < set.blocks.size(); b++)
+        {
+            for (uint32_t k = 0; k < SIMD_WIDTH; k++)
+            {
+                uint32_t o = set.object[b * SIMD_WIDTH + k];
+                if (o != UINT32_MAX)
+                    fill(set.blocks[b], (int)k, static_cast<const Prim *>(objects[o].get()));
+            }
+        }
+        set.bvh.refit([&](uint32_t b) {
+            AABB box, lane;
+            for (uint32_t k = 0; k < SIMD_WIDTH; k++)
+            {
+                uint32_t o = set.object[b * SIMD_WIDTH + k];
+                if (o != UINT32_MAX && objects[o]->getBounds(lane))
+                    box.expand(lane);
+            }
+            return box;
+        });
+    }
+
+    template <typename Block, typename Prim, typename FillFn>
+    static void pack(PackedSet<Block> &set, const std::vector<const Prim *> &prims, const std::vector<uint32_t> &objIdx, FillFn fill)
+    {
+        std::vector<AABB> boxes(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+            prims[i]->getBounds(boxes[i]);
+        set.bvh.build(boxes, SIMD_WIDTH, SIMD_WIDTH);
+
+        // one block per leaf, lanes in leaf order; the leaf now names its block
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        set.blocks.clear();
+        set.object.clear();
+        std::vector<uint32_t> blockIndices;
+        for (size_t n = 0; n < set.bvh.nodes.size(); n++)
+        {
+            BVHNode &node = set.bvh.nodes[n];
+            if (node.count == 0)
+                continue;
+            Block block;
+            float *raw = reinterpret_cast<float *>(&block);
+            for (size_t k = 0; k < sizeof(Block) / sizeof(float); k++)
+                raw[k] = nan;
+            for (uint32_t k = 0; k < SIMD_WIDTH; k++)
+            {
+                if (k < node.count)
+                {
+                    uint32_t p = set.bvh.indices[node.first + k];
+                    fill(block, (int)k, prims[p]);
+                    set.object.push_back(objIdx[p]);
+                }
+                else
+                    set.object.push_back(UINT32_MAX);
+            }
+            node.first = (uint32_t)set.blocks.size();
+            node.count = 1;
+            blockIndices.push_back(node.first);
+            set.blocks.push_back(block);
+        }
+        set.bvh.indices = blockIndices;
+    }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef Quadrics_h
+#define Quadrics_h
+
+#include <cmath>
+#include <limits>
+
+#include "vectors.h"
+#include "functions.h"
+#include "objects.h"
+#include "transform.h"
+
+// Surface a quadric was hit on, kept in HitRecord::sub so that getData
+// does not have to work it out again.
+enum QuadricPart
+{
+    PART_SIDE,
+    PART_TOP,
+    PART_BOTTOM
+};
+
+// Cone, cylinder, disk and capsule in any orientation. Each is laid out in
+// its own frame with the axis along local Y from y = 0 and placed by a
+// rigid Transform. Everything derived from the sizes and the frame (squared
+// radii, slopes, world bounds) is computed once in update(), when the
+// primitive is created or moved, and the intersection takes the ray into
+// the local frame once and returns the nearest of all its surfaces in a
+// single pass.
+class OrientedCylinder : public Object
+{
+public:
+    Transform frame;
+    float radius;
+    float height;
+    MaterialId material;
+
+    OrientedCylinder(const Transform &f, float r, float h, MaterialId m) : frame(f), radius(r), height(h), material(m) { update(); }
+
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        RT_STAT(rayStats.tests[PRIM_CYLINDER]++);
+        Vec3f o = frame.localPoint(orig), d = frame.localDirection(dir);
+        float best = std::numeric_limits<float>::max();
+        uint32_t part = PART_SIDE;
+
+        // the caps lie inside the infinite cylinder: a ray that misses it,
+        // or meets it only behind the origin, misses everything
+        float a = d.x * d.x + d.z * d.z, t0, t1;
+        if (a > 0)
+        {
+            if (!solveQuadratic(a, 2 * (o.x * d.x + o.z * d.z), o.x * o.x + o.z * o.z - r2, t0, t1) || t1 <= 0)
+                return false;
+            if (t0 > 0 && inRange(o.y + t0 * d.y))
+                best = t0;
+            else if (inRange(o.y + t1 * d.y))
+                best = t1;
+        }
+        if (d.y != 0)
+        {
+            float inv = 1 / d.y;
+            capHit(o, d, -o.y * inv, PART_BOTTOM, best, part);
+            capHit(o, d, (height - o.y) * inv, PART_TOP, best, part);
+        }
+        if (best == std::numeric_limits<float>::max())
+            return false;
+        hit.t = best;
+        hit.sub = part;
+        return true;
+    }
+
+    void getData(const Vec3f &hit_point, const HitRecord &hit, Vec3f &N, MaterialId &mat) const
+    {
+        Vec3f p = frame.localPoint(hit_point);
+        if (hit.sub == PART_TOP)
+            N = frame.y;
+        else if (hit.sub == PART_BOTTOM)
+            N = -frame.y;
+        else
+            N = normalize(frame.direction(Vec3f(p.x, 0, p.z)));
+        mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        frame.move(m);
+        update();
+    }
+
+private:
+    float r2;
+    AABB bounds;
+
+    void update()
+    {
+        r2 = radius * radius;
+        bounds = AABB();
+        frame.expandDisk(bounds, Vec3f(0), radius);
+        frame.expandDisk(bounds, Vec3f(0, height, 0), radius);
+    }
+
+    bool inRange(float y) const { return y >= 0 && y <= height; }
+
+    void capHit(const Vec3f &o, const Vec3f &d, float t, uint32_t which, float &best, uint32_t &part) const
+    {
+        float x = o.x + t * d.x, z = o.z + t * d.z;
+        if (t > 0 && t < best && x * x + z * z <= r2)
+        {
+            best = t;
+            part = which;
+        }
+    }
+};
+
+// Base disk of `radius` at y = 0, apex at y = height.
+class OrientedCone : public Object
+{
+public:
+    Transform frame;
+    float radius;
+    float height;
+    MaterialId material;
+
+    OrientedCone(const Transform &f, float r, float h, MaterialId m) : frame(f), radius(r), height(h), material(m) { update(); }
+
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        RT_STAT(rayStats.tests[PRIM_CONE]++);
+        Vec3f o = frame.localPoint(orig), d = frame.localDirection(dir);
+        float best = std::numeric_limits<float>::max();
+        uint32_t part = PART_SIDE;
+
+        // x^2 + z^2 = k (height - y)^2
+        float h = height - o.y;
+        float a = d.x * d.x + d.z * d.z - k * d.y * d.y;
+        float b = 2 * (o.x * d.x + o.z * d.z + k * h * d.y);
+        float c = o.x * o.x + o.z * o.z - k * h * h;
+        float t0, t1;
+        if (std::fabs(a) < 1e-12f) // parallel to the slope: one crossing
+        {
+            if (b != 0)
+            {
+                t0 = -c / b;
+                if (t0 > 0 && inRange(o.y + t0 * d.y))
+                    best = t0;
+            }
+        }
+        else if (solveQuadratic(a, b, c, t0, t1))
+        {
+            if (t0 > 0 && inRange(o.y + t0 * d.y))
+                best = t0;
+            else if (t1 > 0 && inRange(o.y + t1 * d.y))
+                best = t1;
+        }
+        if (d.y != 0)
+        {
+            float t = -o.y / d.y, x = o.x + t * d.x, z = o.z + t * d.z;
+            if (t > 0 && t < best && x * x + z * z <= r2)
+            {
+                best = t;
+                part = PART_BOTTOM;
+            }
+        }
+        if (best == std::numeric_limits<float>::max())
+            return false;
+        hit.t = best;
+        hit.sub = part;
+        return true;
+    }
+
+    void getData(const Vec3f &hit_point, const HitRecord &hit, Vec3f &N, MaterialId &mat) const
+    {
+        if (hit.sub == PART_BOTTOM)
+            N = -frame.y;
+        else
+        {
+            Vec3f p = frame.localPoint(hit_point);
+            N = normalize(frame.direction(Vec3f(p.x, std::sqrt(p.x * p.x + p.z * p.z) * slope, p.z)));
+        }
+        mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        frame.move(m);
+        update();
+    }
+
+private:
+    float r2, slope, k; // radius^2, radius / height, slope^2
+    AABB bounds;
+
+    void update()
+    {
+        r2 = radius * radius;
+        slope = radius / height;
+        k = slope * slope;
+        bounds = AABB();
+        frame.expandDisk(bounds, Vec3f(0), radius);
+        bounds.expand(frame.point(Vec3f(0, height, 0)));
+    }
+
+    bool inRange(float y) const { return y >= 0 && y <= height; }
+};
+
+// Flat disk of `radius` in the local XZ plane, facing local +Y.
+class Disk : public Object
+{
+public:
+    Transform frame;
+    float radius;
+    MaterialId material;
+
+    Disk(const Transform &f, float r, MaterialId m) : frame(f), radius(r), material(m) { update(); }
+
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        RT_STAT(rayStats.tests[PRIM_DISK]++);
+        Vec3f o = frame.localPoint(orig), d = frame.localDirection(dir);
+        if (d.y == 0)
+            return false;
+        float t = -o.y / d.y, x = o.x + t * d.x, z = o.z + t * d.z;
+        if (t <= 0 || x * x + z * z > r2)
+            return false;
+        hit.t = t;
+        hit.sub = PART_TOP;
+        return true;
+    }
+
+    void getData(const Vec3f &hit_point, const HitRecord &hit, Vec3f &N, MaterialId &mat) const
+    {
+        N = frame.y;
+        mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        frame.move(m);
+        update();
+    }
+
+private:
+    float r2;
+    AABB bounds;
+
+    void update()
+    {
+        r2 = radius * radius;
+        bounds = AABB();
+        frame.expandDisk(bounds, Vec3f(0), radius);
+    }
+};
+
+// Points within `radius` of the segment from y = 0 to y = height: a
+// cylinder side between two hemispheres.
+class Capsule : public Object
+{
+public:
+    Transform frame;
+    float radius;
+    float height;
+    MaterialId material;
+
+    Capsule(const Transform &f, float r, float h, MaterialId m) : frame(f), radius(r), height(h), material(m) { update(); }
+
+    bool intersection(const Vec3f &orig, const Vec3f &dir, HitRecord &hit) const
+    {
+        RT_STAT(rayStats.tests[PRIM_CAPSULE]++);
+        Vec3f o = frame.localPoint(orig), d = frame.localDirection(dir);
+        float best = std::numeric_limits<float>::max();
+        uint32_t part = PART_SIDE;
+
+        // the caps lie inside the infinite cylinder: a ray that misses it,
+        // or meets it only behind the origin, misses everything
+        float a = d.x * d.x + d.z * d.z, t0, t1;
+        if (a > 0)
+        {
+            if (!solveQuadratic(a, 2 * (o.x * d.x + o.z * d.z), o.x * o.x + o.z * o.z - r2, t0, t1) || t1 <= 0)
+                return false;
+            if (t0 > 0 && inRange(o.y + t0 * d.y))
+                best = t0;
+            else if (inRange(o.y + t1 * d.y))
+                best = t1;
+        }
+        // hemispheres: only the half beyond the end of the segment is surface
+        float dd = dotProduct(d, d);
+        capHit(o, d, dd, 0, PART_BOTTOM, best, part);
+        capHit(o, d, dd, height, PART_TOP, best, part);
+        if (best == std::numeric_limits<float>::max())
+            return false;
+        hit.t = best;
+        hit.sub = part;
+        return true;
+    }
+
+    void getData(const Vec3f &hit_point, const HitRecord &hit, Vec3f &N, MaterialId &mat) const
+    {
+        Vec3f p = frame.localPoint(hit_point);
+        if (hit.sub == PART_SIDE)
+            p.y = 0;
+        else if (hit.sub == PART_TOP)
+            p.y -= height;
+        N = normalize(frame.direction(p));
+        mat = material;
+    }
+
+    bool getBounds(AABB &box) const
+    {
+        box = bounds;
+        return true;
+    }
+
+    size_t memoryUsage() const { return sizeof(*this); }
+
+    void move(const RigidMotion &m)
+    {
+        frame.move(m);
+        update();
+    }
+
+private:
+    float r2;
+    AABB bounds;
+
+    void update()
+    {
+        r2 = radius * radius;
+        bounds = AABB();
+        Vec3f a = frame.point(Vec3f(0)), b = frame.point(Vec3f(0, height, 0));
+        bounds.expand(a - Vec3f(radius));
+        bounds.expand(a + Vec3f(radius));
+        bounds.expand(b - Vec3f(radius));
+        bounds.expand(b + Vec3f(radius));
+    }
+
+    bool inRange(float y) const { return y >= 0 && y <= height; }
+
+    void capHit(const Vec3f &o, const Vec3f &d, float dd, float y, uint32_t which, float &best, uint32_t &part) const
+    {
+        Vec3f L(o.x, o.y - y, o.z);
+        float t0, t1;
+        if (!solveQuadratic(dd, 2 * dotProduct(d, L), dotProduct(L, L) - r2, t0, t1))
+            return;
+        for (int i = 0; i < 2; i++)
+        {
+            float t = i == 0 ? t0 : t1;
+            float ty = L.y + t * d.y; // relative to the end
+            bool outside = which == PART_TOP ? ty >= 0 : ty <= 0;
+            if (t > 0 && t < best && outside)
+            {
+                best = t;
+                part = which;
+                return;
+            }
+        }
+    }
+};
+
+#endif
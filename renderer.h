@@ -0,0 +1,1271 @@
+#ifndef Renderer_h
+#define Renderer_h
+
+#define _USE_MATH_DEFINES
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <string>
+#include <memory>
+#include <vector>
+#include <mutex>
+
+#include "ImageWriter.h"
+#include "vectors.h"
+#include "objects.h"
+#include "lights.h"
+#include "functions.h"
+#include "bvh.h"
+#include "scene.h"
+#include "envmap.h"
+#include "scenefile.h"
+#include "threadpool.h"
+#include "tiles.h"
+#include "stats.h"
+#include "lib/stb/stb_image.h"
+
+#ifndef RT_SCENE_DIR
+#define RT_SCENE_DIR "../scenes"
+#endif
+
+// The tracer shared by rt and rt_bench: settings, ray evaluation, tile
+// rendering and the loading steps around them.
+
+const uint32_t RED = 0x000000FF;
+const uint32_t GREEN = 0x0000FF00;
+const uint32_t BLUE = 0x00FF0000;
+
+enum TraceMode
+{
+  TRACE_SPLIT,  // dielectrics spawn both the reflected and the refracted ray
+  TRACE_FRESNEL // one of them, chosen with the Fresnel probability
+};
+
+struct Settings
+{
+  int width;
+  int height;
+  float fov;
+  int maxDepth;
+  Vec3f backgroundColor;
+  float Kd;
+  float Ks;
+  float Kg;
+  float AA;
+  int envmap_ineed;
+  int packet; // primary rays traced together, 0 = one at a time
+  int traceMode;     // TRACE_SPLIT or TRACE_FRESNEL for dielectrics
+  float minContrib;  // secondary rays weighing at most this are not traced
+  int rouletteDepth; // Russian roulette from this depth on, 0 = off
+  bool wavefront;    // trace a tile generation by generation instead of ray by ray
+  bool aaAdaptive;   // otherwise every pixel takes AA samples
+  float aaThreshold; // adaptive: stop once the standard error of the pixel drops below
+  int aaMin;
+  int aaMax;
+  bool shadowCache;  // test the last occluder of each light first
+  int lightMode;     // LIGHTS_ALL or LIGHTS_SAMPLE
+  int lightSamples;  // LIGHTS_SAMPLE: shadowed lights picked per hit
+};
+
+// Per-thread counters of the closest-hit path, merged after the frame.
+// "legacy" is what the old code would have spent: getData on every closer
+// hit and a second scene_intersect for every shaded ray.
+struct HitCounters
+{
+  uint64_t intersectCalls = 0;
+  uint64_t occludedCalls = 0;
+  uint64_t getDataCalls = 0;
+  uint64_t legacyIntersectCalls = 0;
+  uint64_t legacyGetDataCalls = 0;
+  uint64_t samples = 0; // primary samples
+  uint64_t culledRays = 0; // secondary rays dropped by contribution or roulette
+
+  HitCounters &operator+=(const HitCounters &c)
+  {
+    intersectCalls += c.intersectCalls;
+    occludedCalls += c.occludedCalls;
+    getDataCalls += c.getDataCalls;
+    legacyIntersectCalls += c.legacyIntersectCalls;
+    legacyGetDataCalls += c.legacyGetDataCalls;
+    samples += c.samples;
+    culledRays += c.culledRays;
+    return *this;
+  }
+};
+
+thread_local HitCounters hitCounters;
+
+void count_closest_hit(bool found, uint64_t closer)
+{
+  hitCounters.intersectCalls++;
+  hitCounters.legacyIntersectCalls += found ? 2 : 1;
+  hitCounters.legacyGetDataCalls += found ? 2 * closer : closer;
+}
+
+#ifdef RT_STATS
+// running total of the -heatmap metric on this thread
+uint64_t cost_clock(CostMetric metric)
+{
+  if (metric == COST_CYCLES)
+    return cycleCount();
+  return hitCounters.intersectCalls + hitCounters.occludedCalls;
+}
+#endif
+
+// Closest-hit query. Only fills the compact hit record; normal and material
+// are evaluated once for the winner by the caller.
+bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Scene &scene, HitRecord &hit)
+{
+  const std::vector<std::unique_ptr<Object>> &objects = scene.objects;
+  uint64_t closer = 0;
+  hit.t = std::numeric_limits<float>::max();
+
+  HitRecord h;
+  if (scene.accel == ACCEL_LINEAR)
+  {
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+      if (objects[i]->intersection(orig, dir, h) && h.t < hit.t)
+      {
+        hit = h;
+        hit.index = (uint32_t)i;
+        closer++;
+      }
+    }
+  }
+  else if (scene.accel == ACCEL_SOA)
+    scene.compiled.intersect(orig, dir, objects, hit, closer);
+  else if (scene.accel == ACCEL_PACKED)
+    scene.packed.intersect(orig, dir, objects, hit, closer);
+  else
+  {
+    float tmax = hit.t;
+    scene.bvh.traverse(orig, dir, tmax, [&](uint32_t i, float &t) {
+      if (objects[i]->intersection(orig, dir, h) && h.t < t)
+      {
+        t = h.t;
+        hit = h;
+        hit.index = i;
+        closer++;
+      }
+      return false;
+    });
+    for (size_t k = 0; k < scene.unbounded.size(); k++)
+    {
+      uint32_t i = scene.unbounded[k];
+      if (objects[i]->intersection(orig, dir, h) && h.t < hit.t)
+      {
+        hit = h;
+        hit.index = i;
+        closer++;
+      }
+    }
+  }
+
+  bool found = hit.t < 1000;
+  count_closest_hit(found, closer);
+  return found;
+}
+
+// Closest hit for n primary rays sharing an origin. The BVH modes walk the
+// tree once for the whole packet; the linear modes trace ray by ray.
+void scene_intersect_packet(const Vec3f &orig, const Vec3f *dir, int n, const Scene &scene, HitRecord *hit, bool *found)
+{
+  if (scene.accel != ACCEL_BVH && scene.accel != ACCEL_PACKED)
+  {
+    for (int r = 0; r < n; r++)
+      found[r] = scene_intersect(orig, dir[r], scene, hit[r]);
+    return;
+  }
+
+  const std::vector<std::unique_ptr<Object>> &objects = scene.objects;
+  uint64_t closer[BVH::MAX_PACKET] = {0};
+  for (int r = 0; r < n; r++)
+    hit[r].t = std::numeric_limits<float>::max();
+
+  HitRecord h;
+  if (scene.accel == ACCEL_PACKED)
+    scene.packed.intersectPacket(orig, dir, n, objects, hit, closer);
+  else
+  {
+    float tmax[BVH::MAX_PACKET];
+    for (int r = 0; r < n; r++)
+      tmax[r] = hit[r].t;
+    scene.bvh.traversePacket(orig, dir, n, tmax, [&](uint32_t i, uint32_t mask, float *t) {
+      for (int r = 0; r < n; r++)
+      {
+        if ((mask >> r & 1) && objects[i]->intersection(orig, dir[r], h) && h.t < t[r])
+        {
+          t[r] = h.t;
+          hit[r] = h;
+          hit[r].index = i;
+          closer[r]++;
+        }
+      }
+    });
+    for (size_t k = 0; k < scene.unbounded.size(); k++)
+    {
+      uint32_t i = scene.unbounded[k];
+      for (int r = 0; r < n; r++)
+      {
+        if (objects[i]->intersection(orig, dir[r], h) && h.t < hit[r].t)
+        {
+          hit[r] = h;
+          hit[r].index = i;
+          closer[r]++;
+        }
+      }
+    }
+  }
+
+  for (int r = 0; r < n; r++)
+  {
+    found[r] = hit[r].t < 1000;
+    count_closest_hit(found[r], closer[r]);
+  }
+}
+
+const uint32_t NO_OCCLUDER = 0xFFFFFFFFu;
+
+// Object that blocked the last shadow ray toward each light on this thread,
+// NO_OCCLUDER when that ray was unblocked. Neighbouring pixels are mostly
+// shadowed by the same object, so it is tried before the full query. Any
+// object in the way settles an any-hit query, so a stale entry (another
+// frame, another scene) only costs one test.
+thread_local std::vector<uint32_t> lastOccluder;
+
+// Any-hit query for shadow rays: true as soon as something lies on the ray
+// closer than tmax. Never evaluates normals or materials. `cached` is the
+// lastOccluder entry of the light the ray goes to, or null.
+bool scene_occluded(const Vec3f &orig, const Vec3f &dir, float tmax, const Scene &scene, uint32_t *cached = nullptr)
+{
+  if (dir.x == 0 && dir.y == 0 && dir.z == 0) // AmbientLight: nothing to be blocked along
+    return false;
+  tmax = std::min(tmax, 1000.f); // scene_intersect ignores hits past 1000 as well
+  hitCounters.occludedCalls++;
+  RT_STAT(rayStats.shadow++);
+
+  const std::vector<std::unique_ptr<Object>> &objects = scene.objects;
+  if (cached && *cached < objects.size())
+  {
+    RT_STAT(rayStats.occluderCacheTests++);
+    if (objects[*cached]->occluded(orig, dir, tmax))
+    {
+      RT_STAT(rayStats.occluderCacheHits++);
+      return true;
+    }
+  }
+
+  uint32_t occluder = NO_OCCLUDER;
+  bool blocked = false;
+  if (scene.accel == ACCEL_LINEAR)
+  {
+    for (size_t i = 0; i < objects.size() && !blocked; i++)
+    {
+      if (objects[i]->occluded(orig, dir, tmax))
+      {
+        occluder = (uint32_t)i;
+        blocked = true;
+      }
+    }
+  }
+  else if (scene.accel == ACCEL_SOA)
+    blocked = scene.compiled.occluded(orig, dir, tmax, objects, occluder);
+  else if (scene.accel == ACCEL_PACKED)
+    blocked = scene.packed.occluded(orig, dir, tmax, objects, occluder);
+  else
+  {
+    for (size_t k = 0; k < scene.unbounded.size() && !blocked; k++)
+    {
+      if (objects[scene.unbounded[k]]->occluded(orig, dir, tmax))
+      {
+        occluder = scene.unbounded[k];
+        blocked = true;
+      }
+    }
+    if (!blocked)
+      blocked = scene.bvh.traverse(orig, dir, tmax, [&](uint32_t i, float &t) {
+        if (!objects[i]->occluded(orig, dir, t))
+          return false;
+        occluder = i;
+        return true;
+      });
+  }
+  if (cached)
+    *cached = blocked ? occluder : NO_OCCLUDER;
+  return blocked;
+}
+
+// lastOccluder entry of light i, or null when -shadow_cache is off
+uint32_t *occluder_cache(const Settings &settings, size_t lights, uint32_t i)
+{
+  if (!settings.shadowCache)
+    return nullptr;
+  if (lastOccluder.size() < lights)
+    lastOccluder.resize(lights, NO_OCCLUDER);
+  return &lastOccluder[i];
+}
+
+// color of a ray that leaves the scene (or ran out of depth)
+Vec3f background(const Vec3f &orig, const Vec3f &dir, const EnvironmentMap &envmap, const Settings &settings)
+{
+  if (settings.envmap_ineed == 0)
+  {
+    return settings.backgroundColor;
+  }
+  RT_STAT(rayStats.envLookups++);
+  return envmap.lookup(dir);
+}
+
+uint32_t hash32(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// uniform in [0, 1), advances the per-sample generator state
+float next_random(uint32_t &state)
+{
+  state = hash32(state + 0x9e3779b9u);
+  return (state >> 8) * (1.f / 16777216.f);
+}
+
+// One pending ray of the iterative evaluator and the factor its radiance
+// is scaled by at the pixel.
+struct PathRay
+{
+  Vec3f orig, dir;
+  Vec3f weight;
+  size_t depth;
+
+  PathRay() : depth(0) {}
+  PathRay(const Vec3f &o, const Vec3f &d, const Vec3f &w) : orig(o), dir(d), weight(w), depth(0) {}
+};
+
+// Full split keeps at most one pending sibling per level.
+const int MAX_PATH_STACK = 64;
+
+// Diffuse and specular terms of one light arriving along light_dir.
+void light_terms(const Vec3f &dir, const Vec3f &N, const Material &material, const Vec3f &light_dir, const Vec3f &light_intensity, Vec3f &diffuse, Vec3f &specular)
+{
+  Vec3f reflectionDirection = reflect(-light_dir, N);
+  diffuse = light_intensity * std::max(0.f, dotProduct(light_dir, N));
+  specular = light_intensity * powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), material.specular);
+}
+
+// Light leaving a surface for the given diffuse and specular terms.
+Vec3f surface_color(const Material &material, const Vec3f &diffuse, const Vec3f &specular, const Settings &settings)
+{
+  if (material.materialType == GLOSSY)
+    return diffuse * material.diffuse_color * settings.Kd + material.diffuse_color * specular * 0.6;
+  return diffuse * material.diffuse_color * settings.Kd + specular * settings.Ks; //Kd = 0.8 Ks = 0.2
+}
+
+// REFLECTION and REFLECTION_AND_REFRACTION surfaces only pass light on.
+bool lit_by_lights(const Material &material)
+{
+  return material.materialType != REFLECTION && material.materialType != REFLECTION_AND_REFRACTION;
+}
+
+// Calls fn(light, weight) for the lights a hit at p is shaded with: every
+// light with weight 1, or with -lights sample the unshadowed ones plus
+// lightSamples picks from the light tree, each weighted by 1 / (samples *
+// probability) so that the sum stays an estimate of the full loop.
+template <typename LightFn>
+void for_each_light(const Scene &scene, const Settings &settings, const Vec3f &p, const Vec3f &N, uint32_t &rng, LightFn fn)
+{
+  if (settings.lightMode == LIGHTS_ALL)
+  {
+    for (uint32_t i = 0; i < scene.lights.size(); ++i)
+      fn(i, 1.f);
+    return;
+  }
+  const LightTree &tree = scene.lightTree;
+  for (size_t k = 0; k < tree.unshadowed.size(); k++)
+    fn(tree.unshadowed[k], 1.f);
+  for (int k = 0; k < settings.lightSamples; k++)
+  {
+    uint32_t light;
+    float pdf;
+    if (tree.sample(p, N, next_random(rng), scene.lights, light, pdf))
+      fn(light, 1 / (settings.lightSamples * pdf));
+  }
+}
+
+// Diffuse and specular light reaching hit_point from the unoccluded lights.
+void direct_light(const Vec3f &dir, const Vec3f &hit_point, const Vec3f &N, const Material &material, const Scene &scene, const Settings &settings, Vec3f &diffuse, Vec3f &specular, uint32_t &rng)
+{
+  const std::vector<std::unique_ptr<Light>> &lights = scene.lights;
+  diffuse = 0;
+  specular = 0;
+  for_each_light(scene, settings, hit_point, N, rng, [&](uint32_t i, float weight) {
+    Vec3f shadow_orig = (dotProduct(dir, N) < 0) ? hit_point + N * 1e-4 : hit_point - N * 1e-4;
+    Vec3f light_dir, light_intensity;
+    float light_dist;
+
+    lights[i]->get_LightData(hit_point, light_dir, light_intensity, light_dist);
+
+    if (lights[i]->castsShadows() && scene_occluded(shadow_orig, light_dir, light_dist, scene, occluder_cache(settings, lights.size(), i)))
+      return;
+    Vec3f d, s;
+    light_terms(dir, N, material, light_dir, light_intensity, d, s);
+    diffuse += d * weight;
+    specular += s * weight;
+  });
+}
+
+// Secondary rays leaving a surface point, with their weight relative to the
+// incoming ray. Returns the number written to `children`.
+int scatter(const Vec3f &dir, const Vec3f &hit_point, const Vec3f &N, const Material &material, const Settings &settings, PathRay children[2], uint32_t &rng)
+{
+  switch (material.materialType)
+  {
+  case GLOSSY:
+  {
+    Vec3f reflect_dir = normalize(reflect(dir, N));
+    Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4; // offset the original point to avoid occlusion by the object itself
+    children[0] = PathRay(reflect_orig, reflect_dir, material.diffuse_color * settings.Kg);
+    RT_STAT(rayStats.reflection++);
+    return 1;
+  }
+
+  case REFLECTION_AND_REFRACTION:
+  {
+    float kr;
+    fresnel(dir, N, material.refract, kr);
+    Vec3f reflect_dir = normalize(reflect(dir, N));
+    Vec3f refract_dir = normalize(refract(dir, N, material.refract));
+    Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4;
+    Vec3f refract_orig = (dotProduct(refract_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4;
+    if (settings.traceMode == TRACE_FRESNEL)
+    {
+      // reflect with probability kr, refract otherwise; either carries the full weight
+      if (next_random(rng) < kr)
+      {
+        children[0] = PathRay(reflect_orig, reflect_dir, Vec3f(1));
+        RT_STAT(rayStats.reflection++);
+      }
+      else
+      {
+        children[0] = PathRay(refract_orig, refract_dir, Vec3f(1));
+        RT_STAT(rayStats.refraction++);
+      }
+      return 1;
+    }
+    children[0] = PathRay(reflect_orig, reflect_dir, Vec3f(kr));
+    children[1] = PathRay(refract_orig, refract_dir, Vec3f(1 - kr));
+    RT_STAT(rayStats.reflection++);
+    RT_STAT(rayStats.refraction++);
+    return 2;
+  }
+
+  case REFLECTION:
+  {
+    Vec3f reflect_dir = normalize(reflect(dir, N));
+    Vec3f reflect_orig = (dotProduct(reflect_dir, N) < 0) ? hit_point - N * 1e-4 : hit_point + N * 1e-4;
+    children[0] = PathRay(reflect_orig, reflect_dir, Vec3f(0.8));
+    RT_STAT(rayStats.reflection++);
+    return 1;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+// Shading of a known hit: the light leaving it directly goes to `local`,
+// secondary rays come back in `children` with their weight relative to
+// this ray. Returns the number of children.
+int shade_hit(const PathRay &ray, const HitRecord &hit, const Scene &scene, const Settings &settings, Vec3f &local, PathRay children[2], uint32_t &rng)
+{
+  const Vec3f &dir = ray.dir;
+  Vec3f hit_point = ray.orig + dir * hit.t;
+  Vec3f N;
+  MaterialId id;
+  scene.objects[hit.index]->getData(hit_point, hit, N, id);
+  hitCounters.getDataCalls++;
+  const Material &material = scene.materials.get(id, hit_point);
+
+  local = 0;
+  if (lit_by_lights(material))
+  {
+    Vec3f diffuse, specular;
+    direct_light(dir, hit_point, N, material, scene, settings, diffuse, specular, rng);
+    local = surface_color(material, diffuse, specular, settings);
+  }
+  return scatter(dir, hit_point, N, material, settings, children, rng);
+}
+
+// Weight of `child` at the pixel and its depth follow from `parent`. False
+// when the child is culled by minContrib or loses the roulette from
+// rouletteDepth on; survivors of the roulette are scaled up to stay unbiased.
+bool continue_path(const PathRay &parent, PathRay &child, const Settings &settings, uint32_t &rng)
+{
+  child.weight = parent.weight * child.weight;
+  child.depth = parent.depth + 1;
+  float contrib = std::max(child.weight.x, std::max(child.weight.y, child.weight.z));
+  if (contrib <= settings.minContrib)
+  {
+    hitCounters.culledRays++;
+    return false;
+  }
+  if (settings.rouletteDepth > 0 && child.depth >= (size_t)settings.rouletteDepth && contrib < 1)
+  {
+    if (next_random(rng) >= contrib)
+    {
+      hitCounters.culledRays++;
+      return false;
+    }
+    child.weight = child.weight / contrib;
+  }
+  return true;
+}
+
+// Radiance arriving at orig along dir, evaluated with an explicit stack
+// instead of recursion. `primary` is the first hit when the caller already
+// has it (packets).
+Vec3f trace_ray(
+    const Vec3f &orig, const Vec3f &dir,
+    const HitRecord *primary,
+    const Scene &scene,
+    const EnvironmentMap &envmap,
+    const Settings &settings,
+    uint32_t &rng)
+{
+  PathRay stack[MAX_PATH_STACK];
+  int sp = 0;
+  stack[sp++] = PathRay(orig, dir, Vec3f(1));
+  Vec3f color = 0;
+
+  while (sp > 0)
+  {
+    PathRay ray = stack[--sp];
+    RT_STAT(rayStats.maxDepth = std::max(rayStats.maxDepth, (uint64_t)ray.depth));
+    HitRecord hit;
+    bool found;
+    if (primary && ray.depth == 0)
+    {
+      hit = *primary;
+      found = true;
+    }
+    else
+      found = ray.depth <= (size_t)settings.maxDepth && scene_intersect(ray.orig, ray.dir, scene, hit);
+    if (!found)
+    {
+      color += ray.weight * background(ray.orig, ray.dir, envmap, settings);
+      continue;
+    }
+
+    Vec3f local;
+    PathRay children[2];
+    int n = shade_hit(ray, hit, scene, settings, local, children, rng);
+    color += ray.weight * local;
+
+    for (int c = n - 1; c >= 0; c--)
+    {
+      if (continue_path(ray, children[c], settings, rng) && sp < MAX_PATH_STACK)
+        stack[sp++] = children[c];
+    }
+  }
+  return color;
+}
+
+const int MATERIAL_TYPE_COUNT = GLOSSY + 1;
+
+// Ray of a wavefront generation; `sample` is the batch entry it adds to.
+struct WaveRay
+{
+  PathRay path;
+  uint32_t sample;
+};
+
+struct WaveHit
+{
+  uint32_t ray; // into the current generation
+  Vec3f point, N;
+  const Material *material;
+};
+
+struct ShadowRay
+{
+  Vec3f orig, dir;
+  float dist;
+  Vec3f contribution; // added to the sample when nothing blocks the ray
+  uint32_t sample;
+  uint32_t light;
+};
+
+// Queues of one worker, kept between batches to reuse their storage.
+struct Wavefront
+{
+  std::vector<WaveRay> rays, next;
+  std::vector<HitRecord> records;
+  std::vector<char> found;
+  std::vector<WaveHit> hits[MATERIAL_TYPE_COUNT];
+  std::vector<ShadowRay> shadows;
+};
+
+// trace_ray for a batch of m rays sharing an origin, one generation at a
+// time: the generation is intersected as a whole (primary rays in packets),
+// hits are binned by material type and shaded queue by queue, the shadow
+// rays they emit are traced together, and the next generation is grouped
+// by direction octant. Weights, culling and roulette are those of trace_ray.
+void trace_wavefront(
+    const Vec3f &orig, const Vec3f *dirs, uint32_t *rng, int m,
+    const Scene &scene,
+    const EnvironmentMap &envmap,
+    const Settings &settings,
+    Vec3f *color)
+{
+  thread_local Wavefront wf;
+  const std::vector<std::unique_ptr<Light>> &lights = scene.lights;
+
+  wf.rays.clear();
+  for (int a = 0; a < m; a++)
+  {
+    color[a] = 0;
+    WaveRay r;
+    r.path = PathRay(orig, dirs[a], Vec3f(1));
+    r.sample = (uint32_t)a;
+    wf.rays.push_back(r);
+  }
+
+  while (!wf.rays.empty())
+  {
+    // every ray of a generation has the same depth
+    size_t n = wf.rays.size();
+    bool primary = wf.rays[0].path.depth == 0;
+    RT_STAT(rayStats.maxDepth = std::max(rayStats.maxDepth, (uint64_t)wf.rays[0].path.depth));
+    wf.records.assign(n, HitRecord());
+    wf.found.assign(n, 0);
+    if (primary && settings.packet > 0)
+    {
+      for (size_t b = 0; b < n; b += settings.packet)
+      {
+        int count = (int)std::min(n - b, (size_t)settings.packet);
+        Vec3f d[BVH::MAX_PACKET];
+        bool f[BVH::MAX_PACKET];
+        for (int r = 0; r < count; r++)
+          d[r] = wf.rays[b + r].path.dir;
+        scene_intersect_packet(orig, d, count, scene, &wf.records[b], f);
+        for (int r = 0; r < count; r++)
+          wf.found[b + r] = f[r];
+      }
+    }
+    else if (wf.rays[0].path.depth <= (size_t)settings.maxDepth)
+    {
+      for (size_t i = 0; i < n; i++)
+        wf.found[i] = scene_intersect(wf.rays[i].path.orig, wf.rays[i].path.dir, scene, wf.records[i]);
+    }
+
+    for (int t = 0; t < MATERIAL_TYPE_COUNT; t++)
+      wf.hits[t].clear();
+    for (size_t i = 0; i < n; i++)
+    {
+      const PathRay &ray = wf.rays[i].path;
+      if (!wf.found[i])
+      {
+        color[wf.rays[i].sample] += ray.weight * background(ray.orig, ray.dir, envmap, settings);
+        continue;
+      }
+      WaveHit h;
+      h.ray = (uint32_t)i;
+      h.point = ray.orig + ray.dir * wf.records[i].t;
+      MaterialId id;
+      scene.objects[wf.records[i].index]->getData(h.point, wf.records[i], h.N, id);
+      hitCounters.getDataCalls++;
+      h.material = &scene.materials.get(id, h.point);
+      wf.hits[h.material->materialType].push_back(h);
+    }
+
+    wf.shadows.clear();
+    wf.next.clear();
+    for (int t = 0; t < MATERIAL_TYPE_COUNT; t++)
+    {
+      for (size_t k = 0; k < wf.hits[t].size(); k++)
+      {
+        const WaveHit &h = wf.hits[t][k];
+        const WaveRay &wr = wf.rays[h.ray];
+        const Vec3f &dir = wr.path.dir;
+
+        if (lit_by_lights(*h.material))
+        {
+          for_each_light(scene, settings, h.point, h.N, rng[wr.sample], [&](uint32_t l, float weight) {
+            ShadowRay s;
+            Vec3f light_intensity, diffuse, specular;
+            lights[l]->get_LightData(h.point, s.dir, light_intensity, s.dist);
+            light_terms(dir, h.N, *h.material, s.dir, light_intensity, diffuse, specular);
+            s.contribution = wr.path.weight * surface_color(*h.material, diffuse, specular, settings) * weight;
+            if (!lights[l]->castsShadows())
+            {
+              color[wr.sample] += s.contribution;
+              return;
+            }
+            if (s.contribution.x == 0 && s.contribution.y == 0 && s.contribution.z == 0)
+              return; // nothing to lose to an occluder
+            s.orig = (dotProduct(dir, h.N) < 0) ? h.point + h.N * 1e-4 : h.point - h.N * 1e-4;
+            s.sample = wr.sample;
+            s.light = l;
+            wf.shadows.push_back(s);
+          });
+        }
+
+        PathRay children[2];
+        int c = scatter(dir, h.point, h.N, *h.material, settings, children, rng[wr.sample]);
+        for (int i = 0; i < c; i++)
+        {
+          if (!continue_path(wr.path, children[i], settings, rng[wr.sample]))
+            continue;
+          WaveRay child;
+          child.path = children[i];
+          child.sample = wr.sample;
+          wf.next.push_back(child);
+        }
+      }
+    }
+
+    for (size_t k = 0; k < wf.shadows.size(); k++)
+    {
+      const ShadowRay &s = wf.shadows[k];
+      if (!scene_occluded(s.orig, s.dir, s.dist, scene, occluder_cache(settings, lights.size(), s.light)))
+        color[s.sample] += s.contribution;
+    }
+
+    // counting sort of the next generation by direction octant
+    size_t start[9] = {0};
+    for (size_t i = 0; i < wf.next.size(); i++)
+    {
+      const Vec3f &d = wf.next[i].path.dir;
+      start[1 + ((d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2)]++;
+    }
+    for (int o = 1; o < 9; o++)
+      start[o] += start[o - 1];
+    wf.rays.resize(wf.next.size());
+    for (size_t i = 0; i < wf.next.size(); i++)
+    {
+      const Vec3f &d = wf.next[i].path.dir;
+      wf.rays[start[(d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2]++] = wf.next[i];
+    }
+  }
+}
+
+// Offset of AA sub-sample k inside pixel (i, j). Fixed AA keeps the old
+// diagonal; adaptive AA walks the R2 sequence from a per-pixel rotation, so
+// any prefix of it is well spread and the image does not depend on threads.
+void sample_offset(size_t i, size_t j, size_t k, const Settings &settings, double &dx, double &dy)
+{
+  if (!settings.aaAdaptive)
+  {
+    dx = 0.5 + k * 0.25;
+    dy = 0.5 - k * 0.25;
+    return;
+  }
+  uint32_t h = hash32((uint32_t)i * 73856093u ^ (uint32_t)j * 19349663u);
+  double rx = (h & 0xFFFF) / 65536.0, ry = (h >> 16) / 65536.0;
+  dx = rx + k * 0.7548776662466927;
+  dy = ry + k * 0.5698402909980532;
+  dx -= std::floor(dx);
+  dy -= std::floor(dy);
+}
+
+// direction of AA sub-sample k through pixel (i, j)
+Vec3f primary_dir(size_t i, size_t j, size_t k, const Settings &settings, float scale, float imageAspectRatio)
+{
+  double dx, dy;
+  sample_offset(i, j, k, settings, dx, dy);
+  float x = (2 * (i + dx) / (float)settings.width - 1) * imageAspectRatio * scale;
+  float y = (2 * (j + dy) / (float)settings.height - 1) * scale;
+  return normalize(Vec3f(x, y, -1));
+}
+
+// luminance of a sample as it will end up on screen
+float display_luminance(Vec3f c)
+{
+  float max = std::max(c.x, std::max(c.y, c.z));
+  if (max > 1)
+    c = c / max;
+  return 0.2126f * std::max(0.f, c.x) + 0.7152f * std::max(0.f, c.y) + 0.0722f * std::max(0.f, c.z);
+}
+
+
+// Everything a worker needs to render tiles of one frame.
+struct FrameContext
+{
+  const Scene *scene;
+  const EnvironmentMap *envmap;
+  const Settings *settings;
+  Vec3f camera;
+  float scale;
+  float imageAspectRatio;
+  // float planes (red, then green and blue `plane` floats further)
+  // holding rows imageY0 and up
+  float *image;
+  size_t plane;
+  int imageY0;
+#ifdef RT_STATS
+  float *cost; // width * height, same row order as image; null without -heatmap
+  CostMetric costMetric;
+#endif
+};
+
+// Renders the pixels of `tile` in the given order. In packet mode the next
+// `packet` pixels of that order share the primary intersection. Adaptive AA
+// traces aaMin samples for each of them, then keeps adding one sample to the
+// pixels whose standard error is still above the threshold, up to aaMax.
+void render_tile(const FrameContext &frame, const Tile &tile, const std::vector<TilePixel> &order)
+{
+  const Settings &settings = *frame.settings;
+  const Scene &scene = *frame.scene;
+  const EnvironmentMap &envmap = *frame.envmap;
+  int batch = settings.wavefront ? (int)order.size() : (settings.packet > 0 ? settings.packet : 1);
+  size_t baseSamples = settings.aaAdaptive ? settings.aaMin : (size_t)settings.AA;
+
+  std::vector<size_t> px(batch), py(batch), taken(batch);
+  std::vector<Vec3f> sum(batch), dirs(batch), color(batch);
+  std::vector<float> lum(batch), lum2(batch);
+  std::vector<int> active(batch);
+  std::vector<uint32_t> rng(batch);
+#ifdef RT_STATS
+  // Work done since `mark` goes in equal shares to the m pixels listed in
+  // `which`: a packet splits its shared traversal, a wavefront batch
+  // everything it traced.
+  std::vector<float> cost(batch);
+  auto charge = [&](const int *which, int m, uint64_t &mark) {
+    if (!frame.cost)
+      return;
+    uint64_t now = cost_clock(frame.costMetric);
+    for (int a = 0; a < m; a++)
+      cost[which[a]] += (float)(now - mark) / m;
+    mark = now;
+  };
+#endif
+
+  // one more sample (number k) for each of the m pixels listed in `which`
+  auto trace = [&](const int *which, int m, size_t k) {
+    RT_STAT(rayStats.primary += m);
+    for (int a = 0; a < m; a++)
+    {
+      dirs[a] = primary_dir(px[which[a]], py[which[a]], k, settings, frame.scale, frame.imageAspectRatio);
+      rng[a] = hash32((uint32_t)(py[which[a]] * settings.width + px[which[a]]) * 64 + (uint32_t)k);
+    }
+#ifdef RT_STATS
+    uint64_t mark = frame.cost ? cost_clock(frame.costMetric) : 0;
+#endif
+    if (settings.wavefront)
+    {
+      trace_wavefront(frame.camera, dirs.data(), rng.data(), m, scene, envmap, settings, color.data());
+      RT_STAT(charge(which, m, mark));
+    }
+    else if (settings.packet > 0)
+    {
+      HitRecord hits[BVH::MAX_PACKET];
+      bool found[BVH::MAX_PACKET];
+      scene_intersect_packet(frame.camera, dirs.data(), m, scene, hits, found);
+      RT_STAT(charge(which, m, mark));
+      for (int a = 0; a < m; a++)
+      {
+        color[a] = found[a] ? trace_ray(frame.camera, dirs[a], &hits[a], scene, envmap, settings, rng[a]) : background(frame.camera, dirs[a], envmap, settings);
+        RT_STAT(charge(which + a, 1, mark));
+      }
+    }
+    else
+    {
+      for (int a = 0; a < m; a++)
+      {
+        color[a] = trace_ray(frame.camera, dirs[a], nullptr, scene, envmap, settings, rng[a]);
+        RT_STAT(charge(which + a, 1, mark));
+      }
+    }
+    for (int a = 0; a < m; a++)
+    {
+      int r = which[a];
+      sum[r] += color[a];
+      float l = display_luminance(color[a]);
+      lum[r] += l;
+      lum2[r] += l * l;
+    }
+    hitCounters.samples += m;
+  };
+
+  size_t next = 0;
+  while (next < order.size())
+  {
+    int n = 0;
+    while (n < batch && next < order.size())
+    {
+      const TilePixel &p = order[next++];
+      if (tile.x0 + p.x < tile.x1 && tile.y0 + p.y < tile.y1)
+      {
+        px[n] = tile.x0 + p.x;
+        py[n] = tile.y0 + p.y;
+        sum[n] = Vec3f(0, 0, 0);
+        lum[n] = lum2[n] = 0;
+        RT_STAT(cost[n] = 0);
+        active[n] = n;
+        n++;
+      }
+    }
+
+    size_t samples = 0;
+    for (; samples < baseSamples; samples++)
+      trace(active.data(), n, samples);
+    for (int r = 0; r < n; r++)
+      taken[r] = samples;
+
+    // pixels leave the active list for good, so the ones left share a sample count
+    int m = settings.aaAdaptive ? n : 0;
+    for (; m > 0 && samples < (size_t)settings.aaMax; samples++)
+    {
+      int keep = 0;
+      for (int a = 0; a < m; a++)
+      {
+        int r = active[a];
+        float mean = lum[r] / samples;
+        float variance = std::max(0.f, (lum2[r] - samples * mean * mean) / (samples - 1));
+        if (std::sqrt(variance / samples) > settings.aaThreshold)
+          active[keep++] = r;
+      }
+      m = keep;
+      if (m == 0)
+        break;
+      trace(active.data(), m, samples);
+      for (int a = 0; a < m; a++)
+        taken[active[a]]++;
+    }
+
+    for (int r = 0; r < n; r++)
+    {
+      Vec3f c = sum[r] * (1.0 / taken[r]);
+      float *p = frame.image + px[r] + (py[r] - frame.imageY0) * settings.width;
+      p[0] = c.x;
+      p[frame.plane] = c.y;
+      p[2 * frame.plane] = c.z;
+      RT_STAT(if (frame.cost) frame.cost[px[r] + py[r] * settings.width] = cost[r]);
+    }
+  }
+}
+
+// Settings that do not come from the scene file, before command-line options.
+Settings default_settings()
+{
+  Settings settings;
+  settings.packet = 0;
+  settings.traceMode = TRACE_SPLIT;
+  settings.minContrib = 0;
+  settings.rouletteDepth = 0;
+  settings.wavefront = false;
+  settings.aaAdaptive = false;
+  settings.aaThreshold = 0.02f;
+  settings.aaMin = 4;
+  settings.aaMax = 16;
+  settings.shadowCache = true;
+  settings.lightMode = LIGHTS_ALL;
+  settings.lightSamples = 1;
+  return settings;
+}
+
+void apply_scene_options(const SceneOptions &options, Settings &settings)
+{
+  settings.width = options.width;
+  settings.height = options.height;
+  settings.AA = options.AA;
+  settings.fov = options.fov;
+  settings.maxDepth = options.maxDepth;
+  settings.backgroundColor = options.background;
+  settings.Kd = options.Kd;
+  settings.Ks = options.Ks;
+  settings.Kg = options.Kg;
+  settings.envmap_ineed = !options.envmap.empty();
+}
+
+// -scene N is scenes/sceneN.txt of the source tree
+std::string scene_path(const std::string &arg)
+{
+  if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos)
+    return std::string(RT_SCENE_DIR) + "/scene" + arg + ".txt";
+  return arg;
+}
+
+// Output file of frame f: the path itself for a single frame, otherwise
+// with the frame number before the extension (out.bmp -> out_0007.bmp).
+std::string frame_path(const std::string &path, int frame, int frames)
+{
+  if (frames <= 1)
+    return path;
+  char number[16];
+  snprintf(number, sizeof(number), "_%04d", frame);
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return path + number;
+  return path.substr(0, dot) + number + path.substr(dot);
+}
+
+bool load_envmap(const std::string &path, EnvLayout layout, bool bilinear, EnvironmentMap &envmap)
+{
+  int width, height, n = -1;
+  unsigned char *pixmap = stbi_load(path.c_str(), &width, &height, &n, 0);
+  if (!pixmap || 3 != n)
+  {
+    std::cerr << "Error: can not load the environment map" << std::endl;
+    return false;
+  }
+  envmap.build(pixmap, width, height, layout, bilinear);
+  stbi_image_free(pixmap);
+  return true;
+}
+
+FrameContext make_frame(const Scene &scene, const EnvironmentMap &envmap, const Settings &settings, const Vec3f &camera, float *image)
+{
+  FrameContext frame;
+  frame.scene = &scene;
+  frame.envmap = &envmap;
+  frame.settings = &settings;
+  frame.camera = camera;
+  frame.scale = tan(deg2rad(settings.fov * 0.5));
+  frame.imageAspectRatio = settings.width / (float)settings.height;
+  frame.image = image;
+  frame.plane = (size_t)settings.height * settings.width;
+  frame.imageY0 = 0;
+#ifdef RT_STATS
+  frame.cost = nullptr;
+  frame.costMetric = COST_RAYS;
+#endif
+  return frame;
+}
+
+// Writes a finished float frame (three planes of width * height) to
+// `path`. Unless the format stores floats, the planes are quantized first
+// as a pass of their own, split over the pool; toneMs is its duration.
+bool save_frame(const std::string &path, const float *image, int width, int height, ThreadPool &pool, const Quantizer &quantize, double &toneMs)
+{
+  size_t plane = (size_t)width * height;
+  ImageWriter writer;
+  bool saved = writer.open(path, imageFormatFromPath(path), width, height);
+  const float *red = image, *green = red + plane, *blue = green + plane;
+  std::vector<uint32_t> packed;
+  toneMs = 0;
+  if (saved && !writer.isFloat())
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    packed.resize(plane);
+    size_t chunk = (plane + pool.size() - 1) / pool.size();
+    pool.run([&](int w) {
+      size_t begin = std::min(plane, w * chunk), end = std::min(plane, begin + chunk);
+      quantize(red + begin, green + begin, blue + begin, packed.data() + begin, end - begin);
+    });
+    toneMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  }
+  for (int y = 0; saved && y < height; y++)
+  {
+    size_t row = (size_t)(writer.topDown() ? height - 1 - y : y) * width;
+    if (writer.isFloat())
+      writer.writeRow(red + row, green + row, blue + row);
+    else
+      writer.writeRow(&packed[row]);
+  }
+  return saved && writer.close();
+}
+
+// Writes the tiles of a split render as a partial image for rt_merge, one
+// rectangle per tile, straight from the float planes of the frame.
+// Identity of a frame for split renders: FNV-1a over the scene (file name
+// and object and light counts), the camera, the frame number and every
+// setting that changes the pixels. Values go in as little-endian words, so
+// parts rendered on different machines agree.
+uint64_t frame_hash(const FrameContext &frame, const std::string &sceneFile, int frameIndex)
+{
+  uint64_t h = 14695981039346656037ull;
+  auto word = [&](uint32_t w) {
+    for (int k = 0; k < 4; k++)
+    {
+      h ^= (w >> (8 * k)) & 0xFF;
+      h *= 1099511628211ull;
+    }
+  };
+  auto real = [&](float f) {
+    uint32_t w;
+    memcpy(&w, &f, sizeof(w));
+    word(w);
+  };
+  size_t slash = sceneFile.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? sceneFile : sceneFile.substr(slash + 1);
+  for (size_t i = 0; i < name.size(); i++)
+    word((unsigned char)name[i]);
+  word((uint32_t)frame.scene->objects.size());
+  word((uint32_t)frame.scene->lights.size());
+  real(frame.camera.x);
+  real(frame.camera.y);
+  real(frame.camera.z);
+  word((uint32_t)frameIndex);
+
+  const Settings &s = *frame.settings;
+  word(s.width);
+  word(s.height);
+  real(s.fov);
+  word(s.maxDepth);
+  real(s.backgroundColor.x);
+  real(s.backgroundColor.y);
+  real(s.backgroundColor.z);
+  real(s.Kd);
+  real(s.Ks);
+  real(s.Kg);
+  real(s.AA);
+  word(s.envmap_ineed);
+  word(s.traceMode);
+  real(s.minContrib);
+  word(s.rouletteDepth);
+  word(s.aaAdaptive);
+  real(s.aaThreshold);
+  word(s.aaMin);
+  word(s.aaMax);
+  word(s.lightMode);
+  word(s.lightSamples);
+  return h;
+}
+
+bool save_partial(const std::string &path, const FrameContext &frame, const std::vector<Tile> &tiles, uint64_t frameHash)
+{
+  int width = frame.settings->width;
+  PartialWriter writer;
+  if (!writer.open(path, width, frame.settings->height, frameHash))
+    return false;
+  for (size_t i = 0; i < tiles.size(); i++)
+  {
+    const Tile &t = tiles[i];
+    const float *red = frame.image + t.x0 + (size_t)(t.y0 - frame.imageY0) * width;
+    writer.writeRect(t.x0, t.y0, t.x1, t.y1, red, red + frame.plane, red + 2 * frame.plane, width);
+  }
+  return writer.close();
+}
+
+struct WorkerStats
+{
+  double busy = 0;
+  int tiles = 0;
+  int stolen = 0;
+};
+
+struct FrameStats
+{
+  double wall; // ms
+  std::vector<WorkerStats> workers;
+  HitCounters counters;
+#ifdef RT_STATS
+  RayStats rays;
+#endif
+};
+
+// Renders every tile the scheduler hands out on the pool. With `strips`
+// the tiles go to the strip buffers of the streaming writer instead of
+// frame.image.
+FrameStats render_frame(const FrameContext &frame, ThreadPool &pool, TileScheduler &scheduler, const std::vector<TilePixel> &pixelOrder, StripWriter *strips)
+{
+  FrameStats stats;
+  stats.workers.resize(pool.size());
+  std::mutex countersMutex;
+
+  auto renderStart = std::chrono::steady_clock::now();
+  pool.run([&](int w) {
+    hitCounters = HitCounters();
+    RT_STAT(rayStats = RayStats());
+    Tile tile;
+    bool stolen;
+    while (scheduler.next(w, tile, stolen))
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      if (strips)
+      {
+        int s = strips->stripOf(tile.y0), y1;
+        FrameContext strip = frame;
+        strip.image = strips->acquire(s);
+        strip.plane = strips->planeSize();
+        strips->stripRows(s, strip.imageY0, y1);
+        render_tile(strip, tile, pixelOrder);
+        strips->done(s, (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+      }
+      else
+        render_tile(frame, tile, pixelOrder);
+      stats.workers[w].busy += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+      stats.workers[w].tiles++;
+      stats.workers[w].stolen += stolen;
+    }
+    std::lock_guard<std::mutex> lock(countersMutex);
+    stats.counters += hitCounters;
+    RT_STAT(stats.rays += rayStats);
+  });
+  stats.wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+  return stats;
+}
+
+#ifdef RT_STATS
+void print_ray_stats(const RayStats &s, const HitCounters &counters)
+{
+  std::cout << "stats: primary " << s.primary << ", shadow " << s.shadow << ", reflection " << s.reflection << ", refraction " << s.refraction
+            << " rays (secondary as spawned, " << counters.culledRays << " of them culled)" << std::endl;
+  std::cout << "  intersection tests:";
+  uint64_t total = 0;
+  for (int k = 0; k < PRIM_KIND_COUNT; k++)
+  {
+    if (s.tests[k])
+      std::cout << " " << primitiveKindName(k) << " " << s.tests[k] << ",";
+    total += s.tests[k];
+  }
+  std::cout << " total " << total << std::endl;
+  std::cout << "  getData: " << counters.getDataCalls << ", max depth reached: " << s.maxDepth << ", envmap lookups: " << s.envLookups << std::endl;
+  if (s.occluderCacheTests) // -shadow_cache 0 tries none
+    std::cout << "  occluder cache: " << s.occluderCacheHits << " hits of " << s.occluderCacheTests << " tests ("
+              << 100.0 * s.occluderCacheHits / s.occluderCacheTests << "%), "
+              << 100.0 * s.occluderCacheHits / std::max<uint64_t>(1, s.shadow) << "% of shadow rays" << std::endl;
+}
+
+// False-colour picture of per-pixel cost, black through blue, cyan, green
+// and yellow to red. The scale ends at the 99th percentile so a handful of
+// expensive pixels do not flatten the rest; `top` returns that value. A
+// .pfm gets the raw cost in every channel instead.
+bool write_heatmap(const std::string &path, const float *cost, int width, int height, float &top)
+{
+  size_t n = (size_t)width * height;
+  std::vector<float> sorted(cost, cost + n);
+  size_t q = n * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + q, sorted.end());
+  top = n ? sorted[q] : 0;
+  float scale = top > 0 ? 1 / top : 0;
+
+  static const Vec3f ramp[] = {Vec3f(0, 0, 0), Vec3f(0, 0, 1), Vec3f(0, 1, 1), Vec3f(0, 1, 0), Vec3f(1, 1, 0), Vec3f(1, 0, 0)};
+  const int steps = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+  ImageWriter writer;
+  if (!writer.open(path, imageFormatFromPath(path), width, height))
+    return false;
+  std::vector<uint32_t> row(width);
+  for (int y = 0; y < height; y++)
+  {
+    const float *c = cost + (size_t)(writer.topDown() ? height - 1 - y : y) * width;
+    if (writer.isFloat())
+    {
+      writer.writeRow(c, c, c);
+      continue;
+    }
+    for (int x = 0; x < width; x++)
+    {
+      float f = std::min(1.f, c[x] * scale) * steps;
+      int i = std::min(steps - 1, (int)f);
+      Vec3f v = ramp[i] * (1 - (f - i)) + ramp[i + 1] * (f - i);
+      row[x] = (uint32_t)(255 * v.z) << 16 | (uint32_t)(255 * v.y) << 8 | (uint32_t)(255 * v.x);
+    }
+    writer.writeRow(row.data());
+  }
+  return writer.close();
+}
+#endif
+
+#endif
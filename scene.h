@@ -0,0 +1,110 @@
+#ifndef Scene_h
+#define Scene_h
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+#include "lights.h"
+#include "materials.h"
+#include "bvh.h"
+#include "compiled.h"
+#include "packed.h"
+#include "lighttree.h"
+
+enum AccelType
+{
+    ACCEL_LINEAR, // virtual intersection over the Object list
+    ACCEL_SOA,    // type-by-type loops over the compiled scene
+    ACCEL_BVH,
+    ACCEL_PACKED  // per-type BVHs with SIMD leaf kernels
+};
+
+// Objects [first, last) take `step` once per animation frame.
+struct ObjectMotion
+{
+    uint32_t first, last;
+    RigidMotion step;
+};
+
+struct Scene
+{
+    std::vector<std::unique_ptr<Object>> objects;
+    std::vector<std::unique_ptr<Light>> lights;
+    MaterialTable materials;
+
+    AccelType accel = ACCEL_BVH;
+    BVH bvh;
+    std::vector<uint32_t> unbounded; // planes, tested linearly next to the BVH
+    CompiledScene compiled;
+    SimdLevel simd = SIMD_AVX2;
+    PackedScene packed;
+    std::vector<ObjectMotion> motions;
+    LightTree lightTree;
+
+    void build()
+    {
+        lightTree.build(lights);
+        if (accel == ACCEL_SOA)
+            compiled.build(objects);
+        if (accel == ACCEL_PACKED)
+            packed.build(objects, simd);
+        if (accel == ACCEL_BVH)
+            buildBVH();
+    }
+
+    bool animated() const { return !motions.empty(); }
+
+    // one frame of motion; refit() brings the acceleration structure along
+    void animate()
+    {
+        for (size_t k = 0; k < motions.size(); k++)
+            for (uint32_t i = motions[k].first; i < motions[k].last; i++)
+                objects[i]->move(motions[k].step);
+    }
+
+    // The hierarchies keep their topology and only get new boxes, which
+    // stays valid (if slowly less tight) however far things move. The SoA
+    // copies have no hierarchy and are simply reloaded.
+    void refit()
+    {
+        if (accel == ACCEL_SOA)
+            compiled.build(objects);
+        if (accel == ACCEL_PACKED)
+            packed.refit(objects);
+        if (accel == ACCEL_BVH)
+            bvh.refit([&](uint32_t i) {
+                AABB box;
+                objects[i]->getBounds(box);
+                return box;
+            });
+    }
+
+    void buildBVH()
+    {
+        std::vector<AABB> boxes;
+        std::vector<uint32_t> bounded;
+        unbounded.clear();
+        boxes.reserve(objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++)
+        {
+            AABB box;
+            if (objects[i]->getBounds(box))
+            {
+                boxes.push_back(box);
+                bounded.push_back(i);
+            }
+            else
+                unbounded.push_back(i);
+        }
+
+        bvh.build(boxes);
+        // let the leaves point straight at the objects
+        for (size_t k = 0; k < bvh.indices.size(); k++)
+            bvh.indices[k] = bounded[bvh.indices[k]];
+    }
+};
+
+#endif
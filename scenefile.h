@@ -0,0 +1,610 @@
+#ifndef SceneFile_h
+#define SceneFile_h
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vectors.h"
+#include "objects.h"
+#include "lights.h"
+#include "scene.h"
+#include "mesh.h"
+#include "quadrics.h"
+#include "instance.h"
+#include "meshloader.h"
+
+// What a scene file sets besides geometry, materials and lights, with the
+// values used when it does not.
+struct SceneOptions
+{
+    int width = 1024;
+    int height = 796;
+    int AA = 1;
+    float fov = 90;
+    int maxDepth = 6;
+    Vec3f background = Vec3f(0);
+    float Kd = 0.8f, Ks = 0.2f, Kg = 0.4f;
+    Vec3f camera = Vec3f(0, 0, 1.5);
+    std::string envmap; // resolved against the scene file, empty = none
+};
+
+// Line-oriented scene description, one directive per line, '#' starts a
+// comment. Vectors are three numbers; materials are referred to by the
+// name they were declared with earlier in the file.
+//
+//   resolution <width> <height>        aa <samples>
+//   fov <degrees>                      maxdepth <n>
+//   background <rgb>                   shading <Kd> <Ks> <Kg>
+//   camera <position>                  envmap <image>
+//   material <name> <rgb> diffuse|glossy|reflection|refraction|glass <specular> <ior>
+//   pattern <name> stripes_x|checker_xz <scale> <odd material> <even material>
+//   sphere <center> <radius> <material>
+//   triangle <a> <b> <c> <material>
+//   plane <point> <normal> <material>
+//   cone|cylinder <base center> <radius> <height> <material>
+//   ocone|ocylinder <base center> <axis> <radius> <height> <material>
+//   disk <center> <normal> <radius> <material>
+//   capsule <end a> <end b> <radius> <material>
+//   mesh <file.obj|file.ply> <center> <size> <material>
+//   light point <position> <intensity> <rgb>
+//   light direct <direction> <intensity> <rgb>
+//   light ambient <intensity> <rgb>
+//   generate spheres|triangles <count> <box min> <box max> <material>...
+//   generate lights <count> <box min> <box max> <total intensity> <rgb>
+//   motion <offset> [<degrees> <pivot>]
+//   geometry <name> ... end
+//   instance <geometry> <position> <yaw degrees> <scale> [<material>]
+//   generate instances <count> <box min> <box max> <geometry> [<material>...]
+//
+// The file is read in one piece and parsed in a single pass that appends
+// straight to the Scene; `generate` scatters primitives with random
+// materials from its list at a density that does not depend on the count,
+// or point lights sharing the intensity so that the scene stays as bright.
+// `motion` animates what the geometry directive before it added (all of a
+// `generate`): every frame turns it by the given degrees about the vertical
+// axis through the pivot, then shifts it by the offset.
+//
+// Between `geometry` and `end` the bounded primitives, meshes and
+// generated primitives go into a named Geometry in their own space instead
+// of the scene; `instance` places it with a turn about the vertical axis
+// and a uniform scale, and may give it one material in place of its own.
+// An instance can be animated with `motion` like any primitive.
+class SceneParser
+{
+public:
+    // count >= 0 replaces the count of the primitive and instance generate
+    // directives (not of generate lights), -1 keeps them
+    SceneParser(Scene &s, SceneOptions &o, long count) : scene(s), options(o), countOverride(count) {}
+
+    bool load(const std::string &path)
+    {
+        file = path;
+        size_t slash = path.find_last_of("/\\");
+        dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f)
+        {
+            std::cerr << "Error: can not open " << path << std::endl;
+            return false;
+        }
+        std::string text;
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            text.append(buf, n);
+        fclose(f);
+
+        // lines are terminated in place, comments cut off the same way
+        char *p = &text[0], *end = p + text.size();
+        for (line = 1; p < end; line++)
+        {
+            char *eol = (char *)memchr(p, '\n', end - p);
+            if (!eol)
+                eol = end;
+            *eol = 0;
+            char *hash = (char *)memchr(p, '#', eol - p);
+            if (hash)
+                *hash = 0;
+            cursor = p;
+            if (!directive())
+                return false;
+            p = eol + 1;
+        }
+        if (geometry)
+            return error("geometry '" + geometryName + "' has no end");
+        return true;
+    }
+
+private:
+    Scene &scene;
+    SceneOptions &options;
+    long countOverride;
+    std::string file, dir;
+    int line;
+    const char *cursor;
+    std::unordered_map<std::string, MaterialId> materials;
+    size_t groupFirst = 0; // first object of the last geometry directive
+    std::unordered_map<std::string, std::shared_ptr<Geometry>> geometries;
+    std::shared_ptr<Geometry> geometry; // open geometry block, if any
+    std::string geometryName;
+
+    bool error(const std::string &message)
+    {
+        std::cerr << "Error: " << file << ":" << line << ": " << message << std::endl;
+        return false;
+    }
+
+    void skipSpace()
+    {
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+            cursor++;
+    }
+
+    bool word(std::string &w)
+    {
+        skipSpace();
+        const char *start = cursor;
+        while (*cursor && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+            cursor++;
+        w.assign(start, cursor);
+        return !w.empty();
+    }
+
+    bool number(float &v)
+    {
+        char *next;
+        v = strtof(cursor, &next);
+        if (next == cursor)
+            return false;
+        cursor = next;
+        return true;
+    }
+
+    bool number(double &v)
+    {
+        char *next;
+        v = strtod(cursor, &next);
+        if (next == cursor)
+            return false;
+        cursor = next;
+        return true;
+    }
+
+    bool number(int &v)
+    {
+        char *next;
+        v = (int)strtol(cursor, &next, 10);
+        if (next == cursor)
+            return false;
+        cursor = next;
+        return true;
+    }
+
+    bool vec(Vec3f &v) { return number(v.x) && number(v.y) && number(v.z); }
+
+    bool material(MaterialId &id)
+    {
+        std::string name;
+        if (!word(name))
+            return false;
+        std::unordered_map<std::string, MaterialId>::const_iterator it = materials.find(name);
+        if (it == materials.end())
+            return error("unknown material '" + name + "'");
+        id = it->second;
+        return true;
+    }
+
+    // where primitives go: the open geometry or the scene
+    std::vector<std::unique_ptr<Object>> &objects() { return geometry ? geometry->objects : scene.objects; }
+
+    bool findGeometry(std::shared_ptr<Geometry> &g)
+    {
+        std::string name;
+        if (!word(name))
+            return false;
+        std::unordered_map<std::string, std::shared_ptr<Geometry>>::const_iterator it = geometries.find(name);
+        if (it == geometries.end())
+            return error("unknown geometry '" + name + "'");
+        g = it->second;
+        return true;
+    }
+
+    bool done()
+    {
+        skipSpace();
+        return *cursor == 0;
+    }
+
+    bool directive()
+    {
+        std::string name;
+        if (!word(name))
+            return true; // blank line
+        if (name == "resolution")
+            return (number(options.width) && number(options.height) && done()) || error("resolution <width> <height>");
+        if (name == "aa")
+            return (number(options.AA) && done()) || error("aa <samples>");
+        if (name == "fov")
+            return (number(options.fov) && done()) || error("fov <degrees>");
+        if (name == "maxdepth")
+            return (number(options.maxDepth) && done()) || error("maxdepth <n>");
+        if (name == "background")
+            return (vec(options.background) && done()) || error("background <r> <g> <b>");
+        if (name == "shading")
+            return (number(options.Kd) && number(options.Ks) && number(options.Kg) && done()) || error("shading <Kd> <Ks> <Kg>");
+        if (name == "camera")
+            return (vec(options.camera) && done()) || error("camera <x> <y> <z>");
+        if (name == "envmap")
+        {
+            std::string image;
+            if (!word(image) || !done())
+                return error("envmap <image>");
+            options.envmap = resolve(image);
+            return true;
+        }
+        if (name == "material")
+            return parseMaterial();
+        if (name == "pattern")
+            return parsePattern();
+        if (name == "light")
+            return parseLight();
+        if (name == "mesh")
+            return parseMesh();
+        if (name == "generate")
+            return parseGenerate();
+        if (name == "motion")
+            return parseMotion();
+        if (name == "geometry")
+            return parseGeometry();
+        if (name == "end")
+            return parseEnd();
+        if (name == "instance")
+            return parseInstance();
+        return parsePrimitive(name);
+    }
+
+    std::string resolve(const std::string &path) const
+    {
+        return path.empty() || path[0] == '/' ? path : dir + path;
+    }
+
+    bool parseMaterial()
+    {
+        std::string name, type;
+        Vec3f color;
+        float specular, ior;
+        if (!word(name) || !vec(color) || !word(type) || !number(specular) || !number(ior) || !done())
+            return error("material <name> <r> <g> <b> <type> <specular> <ior>");
+        MaterialType t;
+        if (type == "diffuse")
+            t = DIFFUSE;
+        else if (type == "glossy")
+            t = GLOSSY;
+        else if (type == "reflection")
+            t = REFLECTION;
+        else if (type == "refraction")
+            t = REFRACTION;
+        else if (type == "glass")
+            t = REFLECTION_AND_REFRACTION;
+        else
+            return error("unknown material type '" + type + "'");
+        materials[name] = scene.materials.add(Material(color, t, specular, ior));
+        return true;
+    }
+
+    bool parsePattern()
+    {
+        std::string name, type;
+        double scale;
+        MaterialId odd, even;
+        if (!word(name) || !word(type) || !number(scale) || !material(odd) || !material(even) || !done())
+            return error("pattern <name> stripes_x|checker_xz <scale> <odd> <even>");
+        MaterialPattern pattern;
+        if (type == "stripes_x")
+            pattern = PATTERN_STRIPES_X;
+        else if (type == "checker_xz")
+            pattern = PATTERN_CHECKER_XZ;
+        else
+            return error("unknown pattern '" + type + "'");
+        materials[name] = scene.materials.addPattern(pattern, scale, odd, even);
+        return true;
+    }
+
+    bool parseLight()
+    {
+        std::string type;
+        Vec3f v, color;
+        float intensity;
+        if (!word(type))
+            return error("light point|direct|ambient ...");
+        if (type == "ambient")
+        {
+            if (!number(intensity) || !vec(color) || !done())
+                return error("light ambient <intensity> <r> <g> <b>");
+            scene.lights.push_back(std::unique_ptr<Light>(new AmbientLight(intensity, color)));
+            return true;
+        }
+        if (!vec(v) || !number(intensity) || !vec(color) || !done())
+            return error("light " + type + " <x> <y> <z> <intensity> <r> <g> <b>");
+        if (type == "point")
+            scene.lights.push_back(std::unique_ptr<Light>(new PointLight(v, intensity, color)));
+        else if (type == "direct")
+            scene.lights.push_back(std::unique_ptr<Light>(new DirectLight(v, intensity, color)));
+        else
+            return error("unknown light type '" + type + "'");
+        return true;
+    }
+
+    bool parsePrimitive(const std::string &name)
+    {
+        Vec3f a, b, c;
+        float r, h;
+        MaterialId m;
+        Object *object;
+        if (name == "sphere")
+        {
+            if (!vec(a) || !number(r) || !material(m) || !done())
+                return error("sphere <x> <y> <z> <radius> <material>");
+            object = new Sphere(a, r, m);
+        }
+        else if (name == "triangle")
+        {
+            if (!vec(a) || !vec(b) || !vec(c) || !material(m) || !done())
+                return error("triangle <a> <b> <c> <material>");
+            object = new Triangle(a, b, c, m);
+        }
+        else if (name == "plane")
+        {
+            if (!vec(a) || !vec(b) || !material(m) || !done())
+                return error("plane <point> <normal> <material>");
+            if (geometry)
+                return error("a plane has no bounds and cannot be part of a geometry");
+            object = new Plane(a, b, m);
+        }
+        else if (name == "cone" || name == "cylinder")
+        {
+            if (!vec(a) || !number(r) || !number(h) || !material(m) || !done())
+                return error(name + " <x> <y> <z> <radius> <height> <material>");
+            object = name == "cone" ? (Object *)new Cone(a, r, h, m) : (Object *)new Cylinder(a, r, h, m);
+        }
+        else if (name == "ocone" || name == "ocylinder")
+        {
+            if (!vec(a) || !vec(b) || !number(r) || !number(h) || !material(m) || !done() || norma(b) == 0)
+                return error(name + " <base x> <y> <z> <axis x> <y> <z> <radius> <height> <material>");
+            Transform frame = Transform::alongAxis(a, b);
+            object = name == "ocone" ? (Object *)new OrientedCone(frame, r, h, m) : (Object *)new OrientedCylinder(frame, r, h, m);
+        }
+        else if (name == "disk")
+        {
+            if (!vec(a) || !vec(b) || !number(r) || !material(m) || !done() || norma(b) == 0)
+                return error("disk <center> <normal> <radius> <material>");
+            object = new Disk(Transform::alongAxis(a, b), r, m);
+        }
+        else if (name == "capsule")
+        {
+            if (!vec(a) || !vec(b) || !number(r) || !material(m) || !done() || norma(b - a) == 0)
+                return error("capsule <end a> <end b> <radius> <material>");
+            object = new Capsule(Transform::alongAxis(a, b - a), r, norma(b - a), m);
+        }
+        else
+            return error("unknown directive '" + name + "'");
+        groupFirst = objects().size();
+        objects().push_back(std::unique_ptr<Object>(object));
+        return true;
+    }
+
+    bool parseMesh()
+    {
+        std::string path;
+        Vec3f at;
+        float size;
+        MaterialId m;
+        if (!word(path) || !vec(at) || !number(size) || !material(m) || !done())
+            return error("mesh <file> <x> <y> <z> <size> <material>");
+        std::unique_ptr<TriangleMesh> mesh(new TriangleMesh(m));
+        if (!loadMesh(resolve(path), *mesh))
+            return error("mesh not loaded");
+        mesh->fit(at, size);
+        mesh->build();
+        groupFirst = objects().size();
+        objects().push_back(std::move(mesh));
+        return true;
+    }
+
+    bool parseGenerate()
+    {
+        std::string type;
+        int count;
+        Vec3f lo, hi;
+        if (!word(type) || (type != "spheres" && type != "triangles" && type != "lights" && type != "instances") || !number(count))
+            return error("generate spheres|triangles|lights|instances <count> <box min> <box max> ...");
+        if (count < 0)
+            return error("generate needs a count of 0 or more");
+        if (!vec(lo) || !vec(hi))
+            return error("generate spheres|triangles|lights|instances <count> <box min> <box max> ...");
+        if (type == "lights")
+            return parseGenerateLights(count, lo, hi);
+        if (type == "instances")
+            return parseGenerateInstances(count, lo, hi);
+        std::vector<MaterialId> palette;
+        MaterialId m;
+        skipSpace();
+        while (*cursor)
+        {
+            if (!material(m))
+                return false;
+            palette.push_back(m);
+            skipSpace();
+        }
+        if (palette.empty())
+            return error("generate needs at least one material");
+        if (countOverride >= 0)
+            count = (int)countOverride;
+
+        // 0.4 for 10000 primitives in a 24 x 12 x 32 box
+        Vec3f ext = hi - lo;
+        float size = 0.4f * cbrtf(10000.f / std::max(1, count) * std::fabs(ext.x * ext.y * ext.z) / 9216.f);
+        std::mt19937 gen(1234);
+        std::uniform_real_distribution<float> px(lo.x, hi.x), py(lo.y, hi.y), pz(lo.z, hi.z), unit(-1, 1);
+        std::uniform_int_distribution<int> pick(0, (int)palette.size() - 1);
+
+        std::vector<std::unique_ptr<Object>> &list = objects();
+        groupFirst = list.size();
+        list.reserve(list.size() + count);
+        for (int i = 0; i < count; i++)
+        {
+            Vec3f c(px(gen), py(gen), pz(gen));
+            m = palette[pick(gen)];
+            if (type == "spheres")
+                list.push_back(std::unique_ptr<Object>(new Sphere(c, size, m)));
+            else
+            {
+                Vec3f a = c + Vec3f(unit(gen), unit(gen), unit(gen)) * size * 2;
+                Vec3f b = c + Vec3f(unit(gen), unit(gen), unit(gen)) * size * 2;
+                Vec3f d = c + Vec3f(unit(gen), unit(gen), unit(gen)) * size * 2;
+                list.push_back(std::unique_ptr<Object>(new Triangle(a, b, d, m)));
+            }
+        }
+        return true;
+    }
+
+    bool parseGenerateLights(int count, const Vec3f &lo, const Vec3f &hi)
+    {
+        float intensity;
+        Vec3f color;
+        if (!number(intensity) || !vec(color) || !done())
+            return error("generate lights <count> <box min> <box max> <total intensity> <r> <g> <b>");
+
+        std::mt19937 gen(1234);
+        std::uniform_real_distribution<float> px(lo.x, hi.x), py(lo.y, hi.y), pz(lo.z, hi.z);
+        for (int i = 0; i < count; i++)
+        {
+            Vec3f p(px(gen), py(gen), pz(gen));
+            scene.lights.push_back(std::unique_ptr<Light>(new PointLight(p, intensity / std::max(1, count), color)));
+        }
+        return true;
+    }
+
+    bool parseMotion()
+    {
+        Vec3f offset, pivot(0);
+        float degrees = 0;
+        if (!vec(offset))
+            return error("motion <dx> <dy> <dz> [<degrees> <pivot x> <y> <z>]");
+        if (!done() && (!number(degrees) || !vec(pivot) || !done()))
+            return error("motion <dx> <dy> <dz> [<degrees> <pivot x> <y> <z>]");
+        if (geometry)
+            return error("motion inside a geometry; animate its instances instead");
+        if (groupFirst >= scene.objects.size())
+            return error("motion needs a primitive, mesh or generate before it");
+        ObjectMotion m;
+        m.first = (uint32_t)groupFirst;
+        m.last = (uint32_t)scene.objects.size();
+        m.step = RigidMotion(offset, pivot, degrees);
+        scene.motions.push_back(m);
+        return true;
+    }
+
+    bool parseGeometry()
+    {
+        std::string name;
+        if (!word(name) || !done())
+            return error("geometry <name>");
+        if (geometry)
+            return error("geometry '" + name + "' inside geometry '" + geometryName + "'");
+        if (geometries.count(name))
+            return error("geometry '" + name + "' declared twice");
+        geometry = std::make_shared<Geometry>();
+        geometryName = name;
+        return true;
+    }
+
+    bool parseEnd()
+    {
+        if (!done())
+            return error("end");
+        if (!geometry)
+            return error("end without geometry");
+        if (geometry->objects.empty())
+            return error("geometry '" + geometryName + "' is empty");
+        geometry->build();
+        geometries[geometryName] = geometry;
+        geometry.reset();
+        groupFirst = scene.objects.size(); // nothing for a motion to animate
+        return true;
+    }
+
+    bool parseInstance()
+    {
+        std::shared_ptr<Geometry> g;
+        Vec3f at;
+        float yaw, scale;
+        if (!findGeometry(g) || !vec(at) || !number(yaw) || !number(scale) || scale <= 0)
+            return error("instance <geometry> <x> <y> <z> <yaw degrees> <scale> [<material>]");
+        if (geometry)
+            return error("instance inside a geometry");
+        Transform frame;
+        frame.move(RigidMotion(at, Vec3f(0), yaw));
+        Instance *instance;
+        MaterialId m;
+        if (done())
+            instance = new Instance(g, frame, scale);
+        else if (material(m) && done())
+            instance = new Instance(g, frame, scale, m);
+        else
+            return error("instance <geometry> <x> <y> <z> <yaw degrees> <scale> [<material>]");
+        groupFirst = scene.objects.size();
+        scene.objects.push_back(std::unique_ptr<Object>(instance));
+        return true;
+    }
+
+    // instances keep the size of their geometry, whatever the count
+    bool parseGenerateInstances(int count, const Vec3f &lo, const Vec3f &hi)
+    {
+        std::shared_ptr<Geometry> g;
+        if (!findGeometry(g))
+            return error("generate instances <count> <box min> <box max> <geometry> [<material>...]");
+        if (geometry)
+            return error("instances inside a geometry");
+        std::vector<MaterialId> palette;
+        MaterialId m;
+        skipSpace();
+        while (*cursor)
+        {
+            if (!material(m))
+                return false;
+            palette.push_back(m);
+            skipSpace();
+        }
+        if (countOverride >= 0)
+            count = (int)countOverride;
+
+        std::mt19937 gen(1234);
+        std::uniform_real_distribution<float> px(lo.x, hi.x), py(lo.y, hi.y), pz(lo.z, hi.z), yaw(0, 360), scale(0.75f, 1.25f);
+        std::uniform_int_distribution<int> pick(0, std::max(0, (int)palette.size() - 1));
+
+        groupFirst = scene.objects.size();
+        scene.objects.reserve(scene.objects.size() + count);
+        for (int i = 0; i < count; i++)
+        {
+            Transform frame;
+            frame.move(RigidMotion(Vec3f(px(gen), py(gen), pz(gen)), Vec3f(0), yaw(gen)));
+            float s = scale(gen);
+            if (palette.empty())
+                scene.objects.push_back(std::unique_ptr<Object>(new Instance(g, frame, s)));
+            else
+                scene.objects.push_back(std::unique_ptr<Object>(new Instance(g, frame, s, palette[pick(gen)])));
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef Server_h
+#define Server_h
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_UNIX_SOCKET 1
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "renderer.h"
+#include "tonemap.h"
+
+// What requests do not choose themselves, from the server's command line.
+struct ServerConfig
+{
+    Settings settings; // before the options of the scene file
+    int threads = 1;
+    int jobs = 1; // requests rendered at the same time
+    AccelType accel = ACCEL_BVH;
+    SimdLevel simd = SIMD_AVX2;
+    int tileSize = 16;
+    TileOrder tileOrder = ORDER_MORTON;
+    ToneMapping toneMapping;
+    EnvLayout envLayout = ENV_LATLONG;
+    bool envBilinear = false;
+};
+
+typedef std::unordered_map<std::string, std::string> RequestParams;
+
+// A request is one line in the syntax of the command line: every -key
+// takes the token after it as its value.
+RequestParams parse_request(const std::string &line)
+{
+    RequestParams params;
+    std::vector<std::string> tokens;
+    std::istringstream in(line);
+    std::string token;
+    while (in >> token)
+        tokens.push_back(token);
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        if (tokens[i][0] != '-')
+            continue;
+        params[tokens[i]] = i + 1 < tokens.size() ? tokens[i + 1] : "";
+        i++;
+    }
+    return params;
+}
+
+// Render daemon. Parsed and built scenes and decoded environment maps are
+// cached for the life of the process (a scene file is parsed again once
+// its modification time changes). `jobs` worker threads each own a pool
+// of threads / jobs render threads and take requests from one queue, so at
+// most `jobs` requests render at a time and the rest wait their turn.
+//
+//   -scene <number|file> -out <file> [-camera x,y,z] [-resolution WxH]
+//   [-aa <samples>] [-count <n>] [-envmap <file>] [-id <tag>]
+//   -shutdown 1
+//
+// Every request is answered with one line, in the order requests finish:
+//   ok id=<tag> out=<file> queue_ms=.. load_ms=.. render_ms=.. write_ms=.. total_ms=..
+//   error id=<tag> <message>
+class RenderServer
+{
+public:
+    explicit RenderServer(const ServerConfig &c) : config(c), stopping(false), shutdownRequested(false), connections(0)
+    {
+        pixelOrder = tilePixelOrder(config.tileSize, config.tileOrder);
+        toneLevel = config.simd;
+        toneKernel = selectToneKernel(toneLevel);
+        int jobs = std::max(1, config.jobs);
+        int perJob = std::max(1, config.threads / jobs);
+        for (int j = 0; j < jobs; j++)
+        {
+            pools.push_back(std::unique_ptr<ThreadPool>(new ThreadPool(perJob)));
+            workers.push_back(std::thread(&RenderServer::work, this, j));
+        }
+        std::cerr << "server: " << jobs << " job(s) of " << perJob << " thread(s)" << std::endl;
+    }
+
+    ~RenderServer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (size_t j = 0; j < workers.size(); j++)
+            workers[j].join();
+    }
+
+    // Requests from standard input, answers on standard output.
+    bool serveStdin()
+    {
+        serveStream([](std::string &line) { return (bool)std::getline(std::cin, line); },
+                    [](const std::string &answer) { std::cout << answer << std::endl; });
+        return true;
+    }
+
+    // Accepts clients on a Unix domain socket until one of them sends
+    // -shutdown; connections already open are served until they close.
+    // Each connection is served like standard input.
+    bool serveSocket(const std::string &path)
+    {
+#ifdef RT_UNIX_SOCKET
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            std::cerr << "Error: socket path too long: " << path << std::endl;
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0)
+        {
+            std::cerr << "Error: cannot listen on " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        std::cerr << "server: listening on " << path << std::endl;
+
+        while (!stopRequested())
+        {
+            int client = accept(listener, NULL, NULL);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break; // shut down from a connection thread, or a real error
+            }
+            {
+                std::lock_guard<std::mutex> lock(connectionMutex);
+                connections++;
+            }
+            std::thread(&RenderServer::serveClient, this, client).detach();
+        }
+
+        std::unique_lock<std::mutex> lock(connectionMutex);
+        closed.wait(lock, [&] { return connections == 0; });
+        close(listener);
+        unlink(path.c_str());
+        return true;
+#else
+        std::cerr << "Error: Unix sockets are not available on this platform, use -serve stdin" << std::endl;
+        return false;
+#endif
+    }
+
+private:
+    struct CachedScene
+    {
+        Scene scene;
+        SceneOptions options;
+    };
+
+    // a loaded or still loading resource and the file time it was read at
+    template <typename T>
+    struct CacheEntry
+    {
+        time_t modified;
+        std::shared_future<std::shared_ptr<T>> value;
+    };
+
+    // requests of one client; replies go out under its mutex
+    struct Connection
+    {
+        std::function<void(const std::string &)> reply;
+        std::mutex mutex;
+        std::condition_variable finished;
+        int pending = 0;
+    };
+
+    struct Job
+    {
+        RequestParams params;
+        std::chrono::steady_clock::time_point received;
+        std::shared_ptr<Connection> connection;
+    };
+
+    ServerConfig config;
+    std::vector<TilePixel> pixelOrder;
+    SimdLevel toneLevel;
+    ToneKernel toneKernel;
+
+    std::vector<std::unique_ptr<ThreadPool>> pools;
+    std::vector<std::thread> workers;
+    std::deque<Job> queue;
+    std::mutex queueMutex;
+    std::condition_variable queued;
+    bool stopping;          // workers leave once the queue is empty
+    bool shutdownRequested; // no new connections
+
+    std::mutex cacheMutex;
+    std::unordered_map<std::string, CacheEntry<CachedScene>> scenes;
+    std::unordered_map<std::string, CacheEntry<EnvironmentMap>> envmaps;
+
+    int listener = -1;
+    std::mutex connectionMutex;
+    std::condition_variable closed;
+    int connections;
+
+    bool stopRequested()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return shutdownRequested;
+    }
+
+    // Queues every request line, then waits until all of them are answered.
+    void serveStream(const std::function<bool(std::string &)> &readLine, const std::function<void(const std::string &)> &reply)
+    {
+        std::shared_ptr<Connection> connection(new Connection());
+        connection->reply = reply;
+        std::string line;
+        while (readLine(line))
+        {
+            RequestParams params = parse_request(line);
+            if (params.empty())
+                continue;
+            if (params.find("-shutdown") != params.end())
+            {
+                requestShutdown();
+                break;
+            }
+            Job job;
+            job.params = params;
+            job.received = std::chrono::steady_clock::now();
+            job.connection = connection;
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                connection->pending++;
+            }
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                queue.push_back(job);
+            }
+            queued.notify_one();
+        }
+        std::unique_lock<std::mutex> lock(connection->mutex);
+        connection->finished.wait(lock, [&] { return connection->pending == 0; });
+    }
+
+    void requestShutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            shutdownRequested = true;
+        }
+#ifdef RT_UNIX_SOCKET
+        if (listener >= 0)
+            shutdown(listener, SHUT_RDWR); // wakes the accept loop
+#endif
+    }
+
+#ifdef RT_UNIX_SOCKET
+    void serveClient(int client)
+    {
+        FILE *in = fdopen(dup(client), "r");
+        auto readLine = [&](std::string &line) {
+            line.clear();
+            char buf[4096];
+            while (in && fgets(buf, sizeof(buf), in))
+            {
+                line += buf;
+                if (line.back() == '\n')
+                    return true;
+            }
+            return !line.empty();
+        };
+        auto reply = [&](const std::string &answer) {
+            std::string text = answer + "\n";
+            for (size_t sent = 0; sent < text.size();)
+            {
+                ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                    return; // client went away, the render still counts
+                sent += n;
+            }
+        };
+        serveStream(readLine, reply);
+        if (in)
+            fclose(in);
+        close(client);
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        connections--;
+        closed.notify_all();
+    }
+#endif
+
+    // Worker j renders queued requests on pools[j]. Jobs still queued at
+    // shutdown are rendered before it returns.
+    void work(int j)
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queued.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                job = queue.front();
+                queue.pop_front();
+            }
+            std::string answer = handle(job, *pools[j]);
+            Connection &c = *job.connection;
+            std::lock_guard<std::mutex> lock(c.mutex);
+            c.reply(answer);
+            if (--c.pending == 0)
+                c.finished.notify_all();
+        }
+    }
+
+    static double msSince(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+    }
+
+    // The first request for a key puts a pending entry in the cache and
+    // loads outside the lock; requests for the same key wait on that entry
+    // alone and requests for anything else are not held up. A failed load
+    // is dropped so that the next request tries again.
+    template <typename T, typename LoadFn>
+    std::shared_ptr<T> cached(std::unordered_map<std::string, CacheEntry<T>> &cache, const std::string &key, time_t modified, LoadFn load)
+    {
+        std::promise<std::shared_ptr<T>> promise;
+        std::shared_future<std::shared_ptr<T>> pending;
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cache.find(key);
+            if (it != cache.end() && it->second.modified == modified)
+                pending = it->second.value;
+            else
+            {
+                // requests still rendering the old one keep it alive
+                CacheEntry<T> entry;
+                entry.modified = modified;
+                entry.value = promise.get_future().share();
+                cache[key] = entry;
+            }
+        }
+        if (pending.valid())
+            return pending.get();
+
+        std::shared_ptr<T> value = load();
+        if (!value)
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cache.find(key);
+            if (it != cache.end() && it->second.modified == modified)
+                cache.erase(it);
+        }
+        promise.set_value(value);
+        return value;
+    }
+
+    std::shared_ptr<CachedScene> loadScene(const std::string &path, long count)
+    {
+        struct stat info;
+        time_t modified = stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+        return cached(scenes, path + "#" + std::to_string(count), modified, [&]() {
+            std::shared_ptr<CachedScene> scene(new CachedScene());
+            SceneParser parser(scene->scene, scene->options, count);
+            if (!parser.load(path))
+                return std::shared_ptr<CachedScene>();
+            scene->scene.accel = config.accel;
+            scene->scene.simd = config.simd;
+            scene->scene.build();
+            return scene;
+        });
+    }
+
+    std::shared_ptr<EnvironmentMap> loadEnvmap(const std::string &path)
+    {
+        return cached(envmaps, path, 0, [&]() {
+            std::shared_ptr<EnvironmentMap> envmap(new EnvironmentMap());
+            if (!load_envmap(path, config.envLayout, config.envBilinear, *envmap))
+                return std::shared_ptr<EnvironmentMap>();
+            return envmap;
+        });
+    }
+
+    std::string handle(const Job &job, ThreadPool &pool)
+    {
+        const RequestParams &params = job.params;
+        auto get = [&](const char *key) {
+            RequestParams::const_iterator it = params.find(key);
+            return it == params.end() ? std::string() : it->second;
+        };
+        std::string id = get("-id");
+        std::string out = get("-out");
+        auto fail = [&](const std::string &message) {
+            std::cerr << "request " << id << ": " << message << std::endl;
+            return "error id=" + id + " " + message;
+        };
+        if (get("-scene").empty() || out.empty())
+            return fail("-scene and -out are required");
+
+        double queueMs = msSince(job.received);
+        auto loadStart = std::chrono::steady_clock::now();
+        std::string scenePath = scene_path(get("-scene"));
+        long count = -1; // as in the file
+        if (!get("-count").empty() && (count = atol(get("-count").c_str())) < 0)
+            return fail("-count needs 0 or more");
+        std::shared_ptr<CachedScene> scene = loadScene(scenePath, count);
+        if (!scene)
+            return fail("cannot load scene " + scenePath);
+
+        Settings settings = config.settings;
+        apply_scene_options(scene->options, settings);
+        Vec3f camera = scene->options.camera;
+        if (!get("-resolution").empty() && (sscanf(get("-resolution").c_str(), "%dx%d", &settings.width, &settings.height) != 2 ||
+                                             settings.width <= 0 || settings.height <= 0 || settings.width > 16384 || settings.height > 16384))
+            return fail("bad -resolution, expected WxH");
+        if (!get("-camera").empty() && sscanf(get("-camera").c_str(), "%f,%f,%f", &camera.x, &camera.y, &camera.z) != 3)
+            return fail("bad -camera, expected x,y,z");
+        if (!get("-aa").empty())
+            settings.AA = std::max(1, atoi(get("-aa").c_str()));
+
+        static const EnvironmentMap noEnvmap;
+        std::shared_ptr<EnvironmentMap> envmap;
+        if (settings.envmap_ineed)
+        {
+            std::string envPath = get("-envmap").empty() ? scene->options.envmap : get("-envmap");
+            envmap = loadEnvmap(envPath);
+            if (!envmap)
+                return fail("cannot load envmap " + envPath);
+        }
+        double loadMs = msSince(loadStart);
+
+        std::vector<float> image(3 * (size_t)settings.width * settings.height);
+        FrameContext frame = make_frame(scene->scene, envmap ? *envmap : noEnvmap, settings, camera, image.data());
+        TileScheduler scheduler;
+        scheduler.reset(settings.width, settings.height, config.tileSize, pool.size());
+        FrameStats stats = render_frame(frame, pool, scheduler, pixelOrder, nullptr);
+
+        auto writeStart = std::chrono::steady_clock::now();
+        Quantizer quantize = [&](const float *r, const float *g, const float *b, unsigned int *packed, size_t n) {
+            toneKernel(r, g, b, packed, n, config.toneMapping);
+        };
+        double toneMs;
+        if (!save_frame(out, image.data(), settings.width, settings.height, pool, quantize, toneMs))
+            return fail("cannot write " + out);
+        double writeMs = msSince(writeStart);
+        double totalMs = msSince(job.received);
+
+        std::ostringstream answer;
+        answer << "ok id=" << id << " out=" << out << " queue_ms=" << queueMs << " load_ms=" << loadMs << " render_ms=" << stats.wall
+               << " write_ms=" << writeMs << " total_ms=" << totalMs;
+        std::cerr << "request " << id << ": " << scenePath << " " << settings.width << "x" << settings.height << ", " << answer.str().substr(answer.str().find("queue_ms")) << std::endl;
+        return answer.str();
+    }
+};
+
+#endif
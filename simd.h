@@ -0,0 +1,309 @@
+#ifndef Simd_h
+#define Simd_h
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+#include "vectors.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// One ray against SIMD_WIDTH spheres or triangles stored lane by lane.
+// Every kernel level does the same float operations in the same order
+// (no FMA), so SSE/AVX2 results are bit-identical to SIMD_REFERENCE.
+// Unused lanes are filled with NaN, which fails every hit comparison.
+
+const int SIMD_WIDTH = 8;
+
+enum SimdLevel
+{
+    SIMD_REFERENCE,
+    SIMD_SSE,
+    SIMD_AVX2
+};
+
+struct SphereBlock
+{
+    float cx[SIMD_WIDTH], cy[SIMD_WIDTH], cz[SIMD_WIDTH], r2[SIMD_WIDTH];
+};
+
+// v0 and the two edges of Moller-Trumbore, precomputed at build time
+struct TriangleBlock
+{
+    float v0x[SIMD_WIDTH], v0y[SIMD_WIDTH], v0z[SIMD_WIDTH];
+    float e1x[SIMD_WIDTH], e1y[SIMD_WIDTH], e1z[SIMD_WIDTH];
+    float e2x[SIMD_WIDTH], e2y[SIMD_WIDTH], e2z[SIMD_WIDTH];
+};
+
+// Kernels return the lane of the nearest hit closer than tmax (and shrink
+// tmax to it), or -1. Ties go to the lowest lane.
+typedef int (*SphereKernel)(const SphereBlock &, const Vec3f &, const Vec3f &, float &);
+typedef int (*TriangleKernel)(const TriangleBlock &, const Vec3f &, const Vec3f &, float &, float &, float &);
+
+int nearestLane(const float *t, float &tmax)
+{
+    int best = -1;
+    for (int k = 0; k < SIMD_WIDTH; k++)
+    {
+        if (t[k] < tmax)
+        {
+            tmax = t[k];
+            best = k;
+        }
+    }
+    return best;
+}
+
+int intersectSpheresReference(const SphereBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    float a = dir.x * dir.x + dir.y * dir.y + dir.z * dir.z;
+    float t[SIMD_WIDTH];
+    for (int k = 0; k < SIMD_WIDTH; k++)
+    {
+        float Lx = orig.x - b.cx[k], Ly = orig.y - b.cy[k], Lz = orig.z - b.cz[k];
+        float hb = dir.x * Lx + dir.y * Ly + dir.z * Lz;
+        float c = (Lx * Lx + Ly * Ly + Lz * Lz) - b.r2[k];
+        float disc = hb * hb - a * c;
+        float sq = sqrtf(disc);
+        float t0 = (-hb - sq) / a;
+        float t1 = (-hb + sq) / a;
+        float tk = (t0 >= 0) ? t0 : t1;
+        t[k] = (disc >= 0 && tk >= 0) ? tk : inf;
+    }
+    return nearestLane(t, tmax);
+}
+
+int intersectTrianglesReference(const TriangleBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax, float &u, float &v)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    float t[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+    for (int k = 0; k < SIMD_WIDTH; k++)
+    {
+        float px = dir.y * b.e2z[k] - dir.z * b.e2y[k];
+        float py = dir.z * b.e2x[k] - dir.x * b.e2z[k];
+        float pz = dir.x * b.e2y[k] - dir.y * b.e2x[k];
+        float det = b.e1x[k] * px + b.e1y[k] * py + b.e1z[k] * pz;
+        float inv = 1.f / det;
+        float sx = orig.x - b.v0x[k], sy = orig.y - b.v0y[k], sz = orig.z - b.v0z[k];
+        float uk = (sx * px + sy * py + sz * pz) * inv;
+        float qx = sy * b.e1z[k] - sz * b.e1y[k];
+        float qy = sz * b.e1x[k] - sx * b.e1z[k];
+        float qz = sx * b.e1y[k] - sy * b.e1x[k];
+        float vk = (dir.x * qx + dir.y * qy + dir.z * qz) * inv;
+        float tk = (b.e2x[k] * qx + b.e2y[k] * qy + b.e2z[k] * qz) * inv;
+        bool hit = uk >= 0 && vk >= 0 && uk + vk <= 1 && tk > 1e-9f;
+        t[k] = hit ? tk : inf;
+        us[k] = uk;
+        vs[k] = vk;
+    }
+    int lane = nearestLane(t, tmax);
+    if (lane >= 0)
+    {
+        u = us[lane];
+        v = vs[lane];
+    }
+    return lane;
+}
+
+#ifdef RT_SIMD_X86
+
+// SSE2 is part of x86-64, so this level needs no target attribute; it runs
+// the 8-lane block as two 4-wide halves.
+int intersectSpheresSSE(const SphereBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 sign = _mm_set1_ps(-0.f);
+    float as = dir.x * dir.x + dir.y * dir.y + dir.z * dir.z;
+    __m128 a = _mm_set1_ps(as);
+    __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+
+    float t[SIMD_WIDTH];
+    for (int h = 0; h < SIMD_WIDTH; h += 4)
+    {
+        __m128 Lx = _mm_sub_ps(ox, _mm_loadu_ps(b.cx + h));
+        __m128 Ly = _mm_sub_ps(oy, _mm_loadu_ps(b.cy + h));
+        __m128 Lz = _mm_sub_ps(oz, _mm_loadu_ps(b.cz + h));
+        __m128 hb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, Lx), _mm_mul_ps(dy, Ly)), _mm_mul_ps(dz, Lz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Lx, Lx), _mm_mul_ps(Ly, Ly)), _mm_mul_ps(Lz, Lz)), _mm_loadu_ps(b.r2 + h));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(hb, hb), _mm_mul_ps(a, c));
+        __m128 sq = _mm_sqrt_ps(disc);
+        __m128 nb = _mm_xor_ps(hb, sign);
+        __m128 t0 = _mm_div_ps(_mm_sub_ps(nb, sq), a);
+        __m128 t1 = _mm_div_ps(_mm_add_ps(nb, sq), a);
+        __m128 front = _mm_cmpge_ps(t0, zero);
+        __m128 tk = _mm_or_ps(_mm_and_ps(front, t0), _mm_andnot_ps(front, t1));
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmpge_ps(tk, zero));
+        _mm_storeu_ps(t + h, _mm_or_ps(_mm_and_ps(hit, tk), _mm_andnot_ps(hit, inf)));
+    }
+    return nearestLane(t, tmax);
+}
+
+int intersectTrianglesSSE(const TriangleBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax, float &u, float &v)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 eps = _mm_set1_ps(1e-9f);
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+
+    float t[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+    for (int h = 0; h < SIMD_WIDTH; h += 4)
+    {
+        __m128 e1x = _mm_loadu_ps(b.e1x + h), e1y = _mm_loadu_ps(b.e1y + h), e1z = _mm_loadu_ps(b.e1z + h);
+        __m128 e2x = _mm_loadu_ps(b.e2x + h), e2y = _mm_loadu_ps(b.e2y + h), e2z = _mm_loadu_ps(b.e2z + h);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv = _mm_div_ps(one, det);
+        __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(b.v0x + h));
+        __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(b.v0y + h));
+        __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(b.v0z + h));
+        __m128 uk = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 vk = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+        __m128 tk = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(uk, zero), _mm_cmpge_ps(vk, zero)),
+                                _mm_and_ps(_mm_cmple_ps(_mm_add_ps(uk, vk), one), _mm_cmpgt_ps(tk, eps)));
+        _mm_storeu_ps(t + h, _mm_or_ps(_mm_and_ps(hit, tk), _mm_andnot_ps(hit, inf)));
+        _mm_storeu_ps(us + h, uk);
+        _mm_storeu_ps(vs + h, vk);
+    }
+    int lane = nearestLane(t, tmax);
+    if (lane >= 0)
+    {
+        u = us[lane];
+        v = vs[lane];
+    }
+    return lane;
+}
+
+__attribute__((target("avx2"))) int intersectSpheresAVX2(const SphereBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    float as = dir.x * dir.x + dir.y * dir.y + dir.z * dir.z;
+    __m256 a = _mm256_set1_ps(as);
+
+    __m256 Lx = _mm256_sub_ps(_mm256_set1_ps(orig.x), _mm256_loadu_ps(b.cx));
+    __m256 Ly = _mm256_sub_ps(_mm256_set1_ps(orig.y), _mm256_loadu_ps(b.cy));
+    __m256 Lz = _mm256_sub_ps(_mm256_set1_ps(orig.z), _mm256_loadu_ps(b.cz));
+    __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+    __m256 hb = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, Lx), _mm256_mul_ps(dy, Ly)), _mm256_mul_ps(dz, Lz));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lx, Lx), _mm256_mul_ps(Ly, Ly)), _mm256_mul_ps(Lz, Lz)), _mm256_loadu_ps(b.r2));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(hb, hb), _mm256_mul_ps(a, c));
+    __m256 sq = _mm256_sqrt_ps(disc);
+    __m256 nb = _mm256_xor_ps(hb, sign);
+    __m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, sq), a);
+    __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, sq), a);
+    __m256 tk = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, zero, _CMP_GE_OQ));
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ), _mm256_cmp_ps(tk, zero, _CMP_GE_OQ));
+
+    float t[SIMD_WIDTH];
+    _mm256_storeu_ps(t, _mm256_blendv_ps(inf, tk, hit));
+    return nearestLane(t, tmax);
+}
+
+__attribute__((target("avx2"))) int intersectTrianglesAVX2(const TriangleBlock &b, const Vec3f &orig, const Vec3f &dir, float &tmax, float &u, float &v)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+
+    __m256 e1x = _mm256_loadu_ps(b.e1x), e1y = _mm256_loadu_ps(b.e1y), e1z = _mm256_loadu_ps(b.e1z);
+    __m256 e2x = _mm256_loadu_ps(b.e2x), e2y = _mm256_loadu_ps(b.e2y), e2z = _mm256_loadu_ps(b.e2z);
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 inv = _mm256_div_ps(one, det);
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(orig.x), _mm256_loadu_ps(b.v0x));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(orig.y), _mm256_loadu_ps(b.v0y));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(orig.z), _mm256_loadu_ps(b.v0z));
+    __m256 uk = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv);
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 vk = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+    __m256 tk = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+    __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(uk, zero, _CMP_GE_OQ), _mm256_cmp_ps(vk, zero, _CMP_GE_OQ)),
+                               _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(uk, vk), one, _CMP_LE_OQ),
+                                             _mm256_cmp_ps(tk, _mm256_set1_ps(1e-9f), _CMP_GT_OQ)));
+
+    float t[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+    _mm256_storeu_ps(t, _mm256_blendv_ps(inf, tk, hit));
+    _mm256_storeu_ps(us, uk);
+    _mm256_storeu_ps(vs, vk);
+    int lane = nearestLane(t, tmax);
+    if (lane >= 0)
+    {
+        u = us[lane];
+        v = vs[lane];
+    }
+    return lane;
+}
+
+#endif
+
+SimdLevel detectSimd()
+{
+#ifdef RT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return SIMD_SSE;
+#else
+    return SIMD_REFERENCE;
+#endif
+}
+
+const char *simdName(SimdLevel level)
+{
+    const char *names[] = {"reference", "sse", "avx2"};
+    return names[level];
+}
+
+struct SimdKernels
+{
+    SphereKernel spheres;
+    TriangleKernel triangles;
+};
+
+// Requests above what the CPU supports are clamped to the best available level.
+SimdKernels selectKernels(SimdLevel &level)
+{
+    SimdLevel best = detectSimd();
+    if (level > best)
+        level = best;
+
+    SimdKernels k;
+    k.spheres = intersectSpheresReference;
+    k.triangles = intersectTrianglesReference;
+#ifdef RT_SIMD_X86
+    if (level == SIMD_SSE)
+    {
+        k.spheres = intersectSpheresSSE;
+        k.triangles = intersectTrianglesSSE;
+    }
+    else if (level == SIMD_AVX2)
+    {
+        k.spheres = intersectSpheresAVX2;
+        k.triangles = intersectTrianglesAVX2;
+    }
+#endif
+    return k;
+}
+
+#endif
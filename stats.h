@@ -0,0 +1,100 @@
+#ifndef Stats_h
+#define Stats_h
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#include "simd.h"
+
+#ifdef RT_SIMD_X86
+#include <x86intrin.h>
+#endif
+
+// Ray and intersection statistics of -stats and -heatmap. They exist only
+// in builds configured with RT_STATS (cmake -DRT_STATS=ON); otherwise
+// RT_STAT expands to nothing and the counters are not even declared.
+#ifdef RT_STATS
+#define RT_STAT(statement) \
+    do                     \
+    {                      \
+        statement;         \
+    } while (0)
+#else
+#define RT_STAT(statement) \
+    do                     \
+    {                      \
+    } while (0)
+#endif
+
+#ifdef RT_STATS
+
+enum PrimitiveKind
+{
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_CONE,
+    PRIM_CYLINDER,
+    PRIM_PLANE,
+    PRIM_MESH_TRIANGLE,
+    PRIM_DISK,
+    PRIM_CAPSULE,
+    PRIM_KIND_COUNT
+};
+
+const char *primitiveKindName(int kind)
+{
+    static const char *names[PRIM_KIND_COUNT] = {"sphere", "triangle", "cone", "cylinder", "plane", "mesh triangle", "disk", "capsule"};
+    return names[kind];
+}
+
+// Per-thread tallies, reset when a worker starts a frame and added up once
+// it has run out of tiles. Packed blocks count every lane, padding included.
+struct RayStats
+{
+    uint64_t primary = 0;
+    uint64_t shadow = 0;     // occlusion queries that reached the scene
+    uint64_t reflection = 0; // spawned, including the ones culled afterwards
+    uint64_t refraction = 0;
+    uint64_t tests[PRIM_KIND_COUNT] = {0};
+    uint64_t envLookups = 0;
+    uint64_t maxDepth = 0; // deepest ray popped, including those past maxDepth
+    uint64_t occluderCacheTests = 0; // shadow rays that tried the cached occluder
+    uint64_t occluderCacheHits = 0;  // ... and were settled by it
+
+    RayStats &operator+=(const RayStats &s)
+    {
+        primary += s.primary;
+        shadow += s.shadow;
+        reflection += s.reflection;
+        refraction += s.refraction;
+        for (int k = 0; k < PRIM_KIND_COUNT; k++)
+            tests[k] += s.tests[k];
+        envLookups += s.envLookups;
+        maxDepth = std::max(maxDepth, s.maxDepth);
+        occluderCacheTests += s.occluderCacheTests;
+        occluderCacheHits += s.occluderCacheHits;
+        return *this;
+    }
+};
+
+thread_local RayStats rayStats;
+
+enum CostMetric
+{
+    COST_RAYS,  // closest-hit and occlusion queries
+    COST_CYCLES // time stamp counter, nanoseconds where there is none
+};
+
+uint64_t cycleCount()
+{
+#ifdef RT_SIMD_X86
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that stay alive between jobs. run() hands the
+// same job to every worker (job(workerIndex)) and returns when all are done;
+// concurrent callers are served one job at a time.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads) : generation(0), pending(0), stopping(false)
+    {
+        if (threads < 1)
+            threads = 1;
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&ThreadPool::loop, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    int size() const { return (int)workers.size(); }
+
+    void run(const std::function<void(int)> &fn)
+    {
+        std::lock_guard<std::mutex> serial(runMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        job = fn;
+        pending = (int)workers.size();
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)> job;
+    unsigned long generation;
+    int pending;
+    bool stopping;
+
+    void loop(int index)
+    {
+        unsigned long seen = 0;
+        for (;;)
+        {
+            std::function<void(int)> current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                current = job;
+            }
+            current(index);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0)
+                    done.notify_all();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef Tiles_h
+#define Tiles_h
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Tile
+{
+    int x0, y0, x1, y1; // [x0, x1) x [y0, y1)
+};
+
+struct TilePixel
+{
+    uint16_t x, y; // offset inside the tile
+};
+
+enum TileOrder
+{
+    ORDER_SCANLINE,
+    ORDER_MORTON,
+    ORDER_HILBERT
+};
+
+TileOrder parseTileOrder(const std::string &name)
+{
+    if (name == "scanline")
+        return ORDER_SCANLINE;
+    if (name == "hilbert")
+        return ORDER_HILBERT;
+    return ORDER_MORTON;
+}
+
+uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+    uint32_t code = 0;
+    for (int b = 0; b < 16; b++)
+        code |= ((x >> b & 1) << (2 * b)) | ((y >> b & 1) << (2 * b + 1));
+    return code;
+}
+
+// position of (x, y) along the Hilbert curve filling an n x n square (n = 2^k)
+uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Visiting order of the pixels of a size x size tile. Clipped edge tiles use
+// the same order and skip what falls outside.
+std::vector<TilePixel> tilePixelOrder(int size, TileOrder order)
+{
+    uint32_t n = 1;
+    while (n < (uint32_t)size)
+        n *= 2;
+
+    std::vector<std::pair<uint32_t, TilePixel>> keyed;
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            TilePixel p;
+            p.x = (uint16_t)x;
+            p.y = (uint16_t)y;
+            uint32_t key = (order == ORDER_MORTON) ? mortonCode(x, y) : (order == ORDER_HILBERT) ? hilbertIndex(n, x, y) : (uint32_t)(y * size + x);
+            keyed.push_back(std::make_pair(key, p));
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint32_t, TilePixel> &a, const std::pair<uint32_t, TilePixel> &b) { return a.first < b.first; });
+
+    std::vector<TilePixel> result(keyed.size());
+    for (size_t i = 0; i < keyed.size(); i++)
+        result[i] = keyed[i].second;
+    return result;
+}
+
+// Tiles covering a width x height frame, bottom tile row first.
+std::vector<Tile> frameTiles(int width, int height, int tileSize)
+{
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tileSize)
+    {
+        for (int x = 0; x < width; x += tileSize)
+        {
+            Tile t;
+            t.x0 = x;
+            t.y0 = y;
+            t.x1 = std::min(width, x + tileSize);
+            t.y1 = std::min(height, y + tileSize);
+            tiles.push_back(t);
+        }
+    }
+    return tiles;
+}
+
+// Tiles of one process of a split render, clipped to picture rows
+// [first, last) counted from the top, as a viewer sees them.
+std::vector<Tile> rowRangeTiles(int width, int height, int tileSize, int first, int last)
+{
+    int y0 = height - std::min(height, last), y1 = height - std::max(0, first);
+    std::vector<Tile> tiles;
+    std::vector<Tile> all = frameTiles(width, height, tileSize);
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        Tile t = all[i];
+        t.y0 = std::max(t.y0, y0);
+        t.y1 = std::min(t.y1, y1);
+        if (t.y0 < t.y1)
+            tiles.push_back(t);
+    }
+    return tiles;
+}
+
+// Tiles [first, last) of the frame in reading order: the top tile row
+// left to right first.
+std::vector<Tile> tileRangeTiles(int width, int height, int tileSize, int first, int last)
+{
+    std::vector<Tile> all = frameTiles(width, height, tileSize);
+    int columns = (width + tileSize - 1) / tileSize, rows = (height + tileSize - 1) / tileSize;
+    std::vector<Tile> tiles;
+    for (int i = std::max(0, first); i < std::min(last, columns * rows); i++)
+        tiles.push_back(all[(rows - 1 - i / columns) * columns + i % columns]);
+    return tiles;
+}
+
+// Per-thread tile deques with work stealing: every worker starts on its own
+// contiguous band of tiles, pops from the front of its deque and, once it
+// runs dry, steals from the back of the others.
+class TileScheduler
+{
+public:
+    void reset(int width, int height, int tileSize, int threads)
+    {
+        reset(frameTiles(width, height, tileSize), threads);
+    }
+
+    // only the given tiles, split into bands the same way
+    void reset(const std::vector<Tile> &tiles, int threads)
+    {
+        queues.clear();
+        for (int i = 0; i < threads; i++)
+            queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        for (size_t k = 0; k < tiles.size(); k++)
+            queues[k * threads / tiles.size()]->tiles.push_back(tiles[k]);
+    }
+
+    // A single queue shared by all threads, tile rows from the bottom up or
+    // from the top down, for output that has to complete rows in sequence.
+    void resetOrdered(int width, int height, int tileSize, bool fromTop)
+    {
+        int rows = (height + tileSize - 1) / tileSize;
+        queues.clear();
+        queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        for (int r = 0; r < rows; r++)
+        {
+            int y = (fromTop ? rows - 1 - r : r) * tileSize;
+            for (int x = 0; x < width; x += tileSize)
+            {
+                Tile t;
+                t.x0 = x;
+                t.y0 = y;
+                t.x1 = std::min(width, x + tileSize);
+                t.y1 = std::min(height, y + tileSize);
+                queues[0]->tiles.push_back(t);
+            }
+        }
+    }
+
+    // false once every deque is empty; `stolen` tells where the tile came from
+    bool next(int thread, Tile &tile, bool &stolen)
+    {
+        {
+            Queue &own = *queues[thread % queues.size()];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tiles.empty())
+            {
+                tile = own.tiles.front();
+                own.tiles.pop_front();
+                stolen = false;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            Queue &victim = *queues[(thread + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tiles.empty())
+            {
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                stolen = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef ToneMap_h
+#define ToneMap_h
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "simd.h"
+
+enum ToneOperator
+{
+    TONE_MAX,      // divide by the largest channel when it exceeds 1 (the original output)
+    TONE_CLAMP,    // clamp every channel to [0, 1]
+    TONE_REINHARD, // c / (1 + c) per channel
+    TONE_ACES      // Narkowicz's fit of the ACES filmic curve
+};
+
+ToneOperator parseToneOperator(const std::string &name)
+{
+    if (name == "clamp")
+        return TONE_CLAMP;
+    if (name == "reinhard")
+        return TONE_REINHARD;
+    if (name == "aces")
+        return TONE_ACES;
+    return TONE_MAX;
+}
+
+// Exposure, tone curve and quantization of the float framebuffer. With a
+// gamma the [0, 1] value is rounded to one of GAMMA_STEPS entries of a
+// table of 8-bit results instead of being scaled by 255.
+struct ToneMapping
+{
+    static const int GAMMA_STEPS = 4096;
+
+    float scale;       // 2^exposure
+    ToneOperator op;
+    std::vector<uint8_t> lut; // empty without gamma
+
+    ToneMapping() : scale(1), op(TONE_MAX) {}
+
+    void setExposure(float stops) { scale = std::pow(2.f, stops); }
+
+    void setGamma(float gamma)
+    {
+        lut.clear();
+        if (gamma <= 0 || gamma == 1)
+            return;
+        // 3 spare bytes so AVX2 can gather 32-bit words at every index
+        lut.assign(GAMMA_STEPS + 3, 0);
+        for (int i = 0; i < GAMMA_STEPS; i++)
+            lut[i] = (uint8_t)(255 * std::pow(i / float(GAMMA_STEPS - 1), 1 / gamma) + 0.5f);
+    }
+};
+
+// n pixels from three planes to 0x00BBGGRR. Every level does the same
+// float operations in the same order, so the results are identical.
+typedef void (*ToneKernel)(const float *r, const float *g, const float *b, uint32_t *out, size_t n, const ToneMapping &tm);
+
+float toneCurve(float c, ToneOperator op)
+{
+    if (op == TONE_REINHARD)
+        return c / (1 + c);
+    if (op == TONE_ACES)
+        return (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+    return c;
+}
+
+uint32_t quantize(float c, const ToneMapping &tm)
+{
+    c = std::max(0.f, std::min(1.f, c));
+    if (!tm.lut.empty())
+        return tm.lut[(int)(c * (ToneMapping::GAMMA_STEPS - 1) + 0.5f)];
+    return (uint32_t)(255 * c);
+}
+
+void toneMapReference(const float *r, const float *g, const float *b, uint32_t *out, size_t n, const ToneMapping &tm)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float x = r[i] * tm.scale, y = g[i] * tm.scale, z = b[i] * tm.scale;
+        if (tm.op == TONE_MAX)
+        {
+            float max = std::max(x, std::max(y, z));
+            if (max > 1)
+            {
+                x = x / max;
+                y = y / max;
+                z = z / max;
+            }
+        }
+        else
+        {
+            x = toneCurve(x, tm.op);
+            y = toneCurve(y, tm.op);
+            z = toneCurve(z, tm.op);
+        }
+        out[i] = quantize(z, tm) << 16 | quantize(y, tm) << 8 | quantize(x, tm);
+    }
+}
+
+#ifdef RT_SIMD_X86
+
+__m128 toneCurveSSE(__m128 c, ToneOperator op)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    if (op == TONE_REINHARD)
+        return _mm_div_ps(c, _mm_add_ps(one, c));
+    if (op == TONE_ACES)
+    {
+        __m128 num = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(0.03f)));
+        __m128 den = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+        return _mm_div_ps(num, den);
+    }
+    return c;
+}
+
+__m128i quantizeSSE(__m128 c, const ToneMapping &tm)
+{
+    c = _mm_max_ps(_mm_min_ps(c, _mm_set1_ps(1.f)), _mm_setzero_ps());
+    if (tm.lut.empty())
+        return _mm_cvttps_epi32(_mm_mul_ps(c, _mm_set1_ps(255.f)));
+    int32_t idx[4];
+    _mm_storeu_si128((__m128i *)idx, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(ToneMapping::GAMMA_STEPS - 1)), _mm_set1_ps(0.5f))));
+    return _mm_setr_epi32(tm.lut[idx[0]], tm.lut[idx[1]], tm.lut[idx[2]], tm.lut[idx[3]]);
+}
+
+void toneMapSSE(const float *r, const float *g, const float *b, uint32_t *out, size_t n, const ToneMapping &tm)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps(tm.scale);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(r + i), scale);
+        __m128 y = _mm_mul_ps(_mm_loadu_ps(g + i), scale);
+        __m128 z = _mm_mul_ps(_mm_loadu_ps(b + i), scale);
+        if (tm.op == TONE_MAX)
+        {
+            // operand order keeps std::max's choice when a channel is NaN
+            __m128 max = _mm_max_ps(_mm_max_ps(z, y), x);
+            __m128 over = _mm_cmpgt_ps(max, one);
+            x = _mm_or_ps(_mm_and_ps(over, _mm_div_ps(x, max)), _mm_andnot_ps(over, x));
+            y = _mm_or_ps(_mm_and_ps(over, _mm_div_ps(y, max)), _mm_andnot_ps(over, y));
+            z = _mm_or_ps(_mm_and_ps(over, _mm_div_ps(z, max)), _mm_andnot_ps(over, z));
+        }
+        else
+        {
+            x = toneCurveSSE(x, tm.op);
+            y = toneCurveSSE(y, tm.op);
+            z = toneCurveSSE(z, tm.op);
+        }
+        __m128i packed = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(quantizeSSE(z, tm), 16), _mm_slli_epi32(quantizeSSE(y, tm), 8)), quantizeSSE(x, tm));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+    toneMapReference(r + i, g + i, b + i, out + i, n - i, tm);
+}
+
+__attribute__((target("avx2"))) __m256 toneCurveAVX2(__m256 c, ToneOperator op)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    if (op == TONE_REINHARD)
+        return _mm256_div_ps(c, _mm256_add_ps(one, c));
+    if (op == TONE_ACES)
+    {
+        __m256 num = _mm256_mul_ps(c, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), c), _mm256_set1_ps(0.03f)));
+        __m256 den = _mm256_add_ps(_mm256_mul_ps(c, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), c), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+        return _mm256_div_ps(num, den);
+    }
+    return c;
+}
+
+__attribute__((target("avx2"))) __m256i quantizeAVX2(__m256 c, const ToneMapping &tm)
+{
+    c = _mm256_max_ps(_mm256_min_ps(c, _mm256_set1_ps(1.f)), _mm256_setzero_ps());
+    if (tm.lut.empty())
+        return _mm256_cvttps_epi32(_mm256_mul_ps(c, _mm256_set1_ps(255.f)));
+    __m256i idx = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(c, _mm256_set1_ps(ToneMapping::GAMMA_STEPS - 1)), _mm256_set1_ps(0.5f)));
+    // gather 32-bit words at byte offsets, keep the low byte
+    __m256i words = _mm256_i32gather_epi32((const int *)tm.lut.data(), idx, 1);
+    return _mm256_and_si256(words, _mm256_set1_epi32(0xFF));
+}
+
+__attribute__((target("avx2"))) void toneMapAVX2(const float *r, const float *g, const float *b, uint32_t *out, size_t n, const ToneMapping &tm)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 scale = _mm256_set1_ps(tm.scale);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(r + i), scale);
+        __m256 y = _mm256_mul_ps(_mm256_loadu_ps(g + i), scale);
+        __m256 z = _mm256_mul_ps(_mm256_loadu_ps(b + i), scale);
+        if (tm.op == TONE_MAX)
+        {
+            __m256 max = _mm256_max_ps(_mm256_max_ps(z, y), x);
+            __m256 over = _mm256_cmp_ps(max, one, _CMP_GT_OQ);
+            x = _mm256_blendv_ps(x, _mm256_div_ps(x, max), over);
+            y = _mm256_blendv_ps(y, _mm256_div_ps(y, max), over);
+            z = _mm256_blendv_ps(z, _mm256_div_ps(z, max), over);
+        }
+        else
+        {
+            x = toneCurveAVX2(x, tm.op);
+            y = toneCurveAVX2(y, tm.op);
+            z = toneCurveAVX2(z, tm.op);
+        }
+        __m256i packed = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(quantizeAVX2(z, tm), 16), _mm256_slli_epi32(quantizeAVX2(y, tm), 8)), quantizeAVX2(x, tm));
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    toneMapReference(r + i, g + i, b + i, out + i, n - i, tm);
+}
+
+#endif
+
+// Requests above what the CPU supports are clamped to the best available level.
+ToneKernel selectToneKernel(SimdLevel &level)
+{
+    SimdLevel best = detectSimd();
+    if (level > best)
+        level = best;
+#ifdef RT_SIMD_X86
+    if (level == SIMD_SSE)
+        return toneMapSSE;
+    if (level == SIMD_AVX2)
+        return toneMapAVX2;
+#endif
+    return toneMapReference;
+}
+
+#endif
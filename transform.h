@@ -0,0 +1,59 @@
+#ifndef Transform_h
+#define Transform_h
+
+#include <cmath>
+
+#include "vectors.h"
+#include "functions.h"
+#include "objects.h"
+
+// Rigid object-to-world transform: an orthonormal basis (the world
+// directions of the local x, y and z axes) and the world position of the
+// local origin. It has no scale, so a ray keeps its parameter t when taken
+// into local space and sizes stay with the primitives.
+struct Transform
+{
+    Vec3f origin;
+    Vec3f x, y, z;
+
+    Transform() : origin(0), x(1, 0, 0), y(0, 1, 0), z(0, 0, 1) {}
+
+    // local Y along `axis`, the other two axes picked to complete the frame
+    static Transform alongAxis(const Vec3f &origin, const Vec3f &axis)
+    {
+        Transform t;
+        t.origin = origin;
+        t.y = normalize(axis);
+        // any world axis not close to y will do as a helper
+        Vec3f helper = std::fabs(t.y.x) < 0.9f ? Vec3f(1, 0, 0) : Vec3f(0, 0, 1);
+        t.z = normalize(crossProduct(helper, t.y));
+        t.x = crossProduct(t.y, t.z);
+        return t;
+    }
+
+    Vec3f point(const Vec3f &p) const { return origin + x * p.x + y * p.y + z * p.z; }
+    Vec3f direction(const Vec3f &d) const { return x * d.x + y * d.y + z * d.z; }
+
+    Vec3f localPoint(const Vec3f &p) const { return localDirection(p - origin); }
+    Vec3f localDirection(const Vec3f &d) const { return Vec3f(dotProduct(d, x), dotProduct(d, y), dotProduct(d, z)); }
+
+    // the same frame after one step of an animation
+    void move(const RigidMotion &m)
+    {
+        origin = m.point(origin);
+        x = m.direction(x);
+        y = m.direction(y);
+        z = m.direction(z);
+    }
+
+    // world box of the local disk of radius r around `center` in the XZ plane
+    void expandDisk(AABB &box, const Vec3f &center, float r) const
+    {
+        Vec3f c = point(center);
+        Vec3f e(r * std::sqrt(std::max(0.f, 1 - y.x * y.x)), r * std::sqrt(std::max(0.f, 1 - y.y * y.y)), r * std::sqrt(std::max(0.f, 1 - y.z * y.z)));
+        box.expand(c - e);
+        box.expand(c + e);
+    }
+};
+
+#endif
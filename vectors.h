@@ -22,6 +22,8 @@ public:
     Vec3f operator-(const Vec3f &v) const { return Vec3f(x - v.x, y - v.y, z - v.z); }
     Vec3f operator+(const Vec3f &v) const { return Vec3f(x + v.x, y + v.y, z + v.z); }
     Vec3f operator-() const { return Vec3f(-x, -y, -z); }
+    const float &operator[](int i) const { return (&x)[i]; }
+    float &operator[](int i) { return (&x)[i]; }
     Vec3f &operator+=(const Vec3f &v)
     {
         x += v.x, y += v.y, z += v.z;